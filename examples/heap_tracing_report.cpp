@@ -1,4 +1,4 @@
-// Build: c++ -std=c++17 -O2 -pthread -rdynamic \
+// Build: c++ -std=c++17 -O2 -g -pthread \
 //        -DOTRACE=1 -DOTRACE_HEAP=1 -DOTRACE_DEFINE_HEAP_HOOKS=1 -DOTRACE_HEAP_STACKS=1 \
 //        examples/heap_tracing_report.cpp -o ex_heap
 #include "otrace.hpp"
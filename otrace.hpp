@@ -30,15 +30,37 @@
  *   -DOTRACE_SYNTHESIZE_TRACKS=1       Enable synthetic tracks at flush (default 0)
  *   -DOTRACE_SYNTH_RATE_WINDOW_US=...  Rolling window for FPS/rates (default 500000)
  *   -DOTRACE_SYNTH_PCT_NAMES="..."     Percentiles for latency summary (default "p50,p95,p99")
+ *   -DOTRACE_SYNTH_STALL_US=N          Min idle gap between top-level slices reported as a stall (default 0 = off)
+ *   -DOTRACE_SYNTH_IDLE_THREADS="..."  CSV of thread names excluded from stall detection (default "")
+ *   -DOTRACE_COUNTER_DOWNSAMPLE="..."  Flush-time counter budgets "name_or_cat=points,...,*=points" (default "")
+ *   -DOTRACE_COALESCE_GAP_US=N         Merge runs of identical events closer than N us at flush (default 0=off)
+ *   -DOTRACE_COALESCE_MAX_US=N         Only coalesce slices no longer than N us (default 0=any)
+ *   -DOTRACE_SCOPE_STATS=1             Keep live per-callsite scope/counter aggregates (default 0)
+ *   -DOTRACE_SCOPE_STATS_SLOTS=512     Distinct scope callsites / counter names per thread (power of two)
  *
  *   // Heap tracer (optional, header-only; off by default)
  *   -DOTRACE_HEAP=1                    Enable heap tracing layer
  *   -DOTRACE_DEFINE_HEAP_HOOKS=1       Define global new/delete wrappers (ONE TU only)
+ *   -DOTRACE_HEAP_HOOK_MALLOC=1        With the hooks, also wrap malloc/calloc/realloc/free/memalign (Linux glibc)
  *   -DOTRACE_HEAP_SAMPLE=0.10          Initial callsite sampling probability (default 0.0)
+ *   -DOTRACE_HEAP_SAMPLE_BYTES=524288  Sample by bytes: mean bytes between samples (default 0 = use probability)
  *   -DOTRACE_HEAP_STACKS=1             Capture short stacks for sampled sites (default 0)
  *   -DOTRACE_HEAP_STACK_DEPTH=8        Max frames per captured stack (default 8)
- *   -DOTRACE_HEAP_SHARDS=64            Shard count for live allocation map (default 64)
+ *   -DOTRACE_HEAP_FP_UNWIND=1          Walk frame pointers instead of backtrace() (needs -fno-omit-frame-pointer)
+ *   -DOTRACE_HEAP_SCOPES=0             Don't charge allocations to the enclosing TRACE_SCOPE (default 1)
+ *   -DOTRACE_HEAP_TABLE_BUCKETS=65536  Buckets in the live allocation table (power of two, 8 slots each; the
+ *                                      overflow pool grows to 256x this, past which allocs go untracked)
+ *   -DOTRACE_HEAP_MAX_SITES=4096       Distinct sampled stacks tracked per thread (power of two)
+ *   -DOTRACE_HEAP_MAX_SNAPSHOTS=16     Named heap snapshots kept for diffing (oldest dropped first)
+ *   -DOTRACE_HEAP_PEAK_MIN_BYTES=N     Live bytes before peak snapshots start (default 1 MiB)
+ *   -DOTRACE_HEAP_MAX_NAMED=32         Named heaps that OTRACE_HEAP_REGISTER can create
+ *   -DOTRACE_HEAP_STACK_FRAMES=0       Put full stack strings in report args instead of "sf" ids into stackFrames
+ *   -DOTRACE_MAX_STACK_FRAMES=65536    Entries in the stackFrames dictionary (further frames fold into their caller)
+ *   -DOTRACE_HEAP_ASYNC=1              Hooks append to per-thread logs; a background thread updates the tables
+ *   -DOTRACE_HEAP_ASYNC_RING=16384     Records per thread log (power of two; a full log makes the hook wait)
  *   -DOTRACE_HEAP_DEMANGLE=1           Demangle C++ symbols in reports if available (default 0)
+ *   -DOTRACE_HEAP_SYMBOLIZE=0          Use backtrace_symbols() instead of reading ELF symtabs and DWARF lines (Linux)
+ *   -DOTRACE_HEAP_DEBUG_DIR="/usr/lib/debug"  Root searched for separate debug files (build-id, debuglink)
  *   -DOTRACE_HEAP_DBGHELP=1            Use DbgHelp on Windows when present (default 0)
  *
  * Environment variables (read once on first use):
@@ -83,6 +105,10 @@
  *   OTRACE_DISABLE_CATS("debug,noise");              // denylist categories
  *   OTRACE_SET_SAMPLING(0.1);                        // keep 10% of events
  *
+ *   // Flush-time compaction
+ *   OTRACE_SET_COUNTER_DOWNSAMPLE("queue_len=2000,io=500"); // keep min/max per bucket, ~N points/series
+ *   OTRACE_SET_COALESCE(5, 50);                      // runs of identical <=50us events, gaps <=5us -> one slice
+ *
  *   // Call-by-name macro (optional sugar)
  *   OTRACE_CALL(SCOPE, "init");                      // expands to OTRACE_SCOPE("init")
  *   OTRACE_CALL(COUNTER, "queue_len", v);            // expands to OTRACE_COUNTER(...)
@@ -91,11 +117,39 @@
  *
  *   // Flush-time synthesis (if compiled in)
  *   OTRACE_ENABLE_SYNTH_TRACKS(true);                // runtime toggle for synthetic tracks
+ *   OTRACE_SET_STALL_THRESHOLD_US(5000);             // gaps >= 5ms between top-level slices -> "stall"
+ *   OTRACE_SET_IDLE_THREADS("io-poller,timer");      // never report stalls on these threads
+ *
+ *   // Live scope statistics (if compiled with OTRACE_SCOPE_STATS)
+ *   std::vector<otrace::ScopeStat> st;
+ *   OTRACE_SCOPE_STATS_SNAPSHOT(st);                 // cumulative count/total/min/max/histogram
+ *   static otrace::ScopeStatsCursor cur;             // one per consumer
+ *   OTRACE_SCOPE_STATS_DELTA(cur, st);               // same, but only what happened since cur's last DELTA
+ *   double p99 = st[0].percentile_us(0.99);          // estimated from log2 buckets
+ *   OTRACE_METRICS_START("metrics/otrace.prom", 10000); // Prometheus text file, rewritten every 10s
+ *                                                    // (a compile error without OTRACE_SCOPE_STATS)
+ *   OTRACE_METRICS_START("unix:/tmp/otrace.sock", 5000); // or served on a local Unix socket
+ *   OTRACE_METRICS_STOP();
+ *
+ *   // Process memory counters (RSS, page faults, malloc arenas) from a background thread
+ *   OTRACE_MEMORY_SAMPLER_START(100);                // every 100 ms
+ *   OTRACE_MEMORY_SAMPLER_STOP();
  *
  *   // Heap tracer controls & report (if compiled with OTRACE_HEAP)
  *   OTRACE_HEAP_ENABLE(true);                        // arm/disarm heap capture at runtime
  *   OTRACE_HEAP_SET_SAMPLING(0.2);                   // adjust callsite sampling (0..1)
- *   OTRACE_HEAP_REPORT();                            // emit heap_report_stats/leaks/sites
+ *   OTRACE_HEAP_SET_SAMPLE_BYTES(512 * 1024);        // sample ~once per 512 KiB allocated (0 = off)
+ *   OTRACE_HEAP_REPORT();                            // emit heap_report_stats/leaks/sites/lifetimes/scopes/ages/suspects/peak
+ *   OTRACE_HEAP_WRITE_PPROF("heap.pb.gz");           // sampled sites as a pprof heap profile
+ *   OTRACE_HEAP_SNAPSHOT("t1");                      // per-site live totals, kept for diffing
+ *   OTRACE_HEAP_DIFF("t1", "t2");                    // top growing sites between snapshots (nullptr = now)
+ *   OTRACE_HEAP_SET_AGE_THRESHOLDS(secs, n);         // live age buckets, seconds (default 1/10/60/600)
+ *   OTRACE_HEAP_TIMELINE_START(250, 8);              // background counters: top-8 sites, per-thread rates
+ *   OTRACE_HEAP_TIMELINE_STOP();
+ *   OTRACE_HEAP_SET_PEAK_MARGIN(0.10);               // re-snapshot sites at each new peak >10% above the last
+ *   uint32_t pool = OTRACE_HEAP_REGISTER("pool");    // named heap for a custom allocator (0 = full)
+ *   OTRACE_HEAP_ALLOC(pool, p, n);                   // report its allocations and frees
+ *   OTRACE_HEAP_FREE(pool, p);
  *
  *   // Global on/off at runtime
  *   TRACE_ENABLE();                               // start recording (alias of OTRACE_ENABLE)
@@ -164,6 +218,12 @@
 #ifndef OTRACE_SYNTH_PCT_NAMES
 #define OTRACE_SYNTH_PCT_NAMES "p50,p95,p99"
 #endif
+#ifndef OTRACE_SYNTH_STALL_US
+#define OTRACE_SYNTH_STALL_US 0      // off; e.g. 10000 reports gaps >= 10ms
+#endif
+#ifndef OTRACE_SYNTH_IDLE_THREADS
+#define OTRACE_SYNTH_IDLE_THREADS ""  // CSV of thread names that idle by design (pollers)
+#endif
 
 #ifndef OTRACE_HEAP
 #define OTRACE_HEAP 0
@@ -173,28 +233,170 @@
 #define OTRACE_DEFINE_HEAP_HOOKS 0
 #endif
 
+#ifndef OTRACE_HEAP_HOOK_MALLOC
+#define OTRACE_HEAP_HOOK_MALLOC 0
+#endif
+
 #ifndef OTRACE_HEAP_SAMPLE
 #define OTRACE_HEAP_SAMPLE 0.0
 #endif
 
+#ifndef OTRACE_HEAP_SAMPLE_BYTES
+#define OTRACE_HEAP_SAMPLE_BYTES 0
+#endif
+
 #ifndef OTRACE_HEAP_STACK_DEPTH
 #define OTRACE_HEAP_STACK_DEPTH 8
 #endif
 
-#ifndef OTRACE_HEAP_SHARDS
-#define OTRACE_HEAP_SHARDS 64
+#if defined(OTRACE_HEAP_SHARDS)
+#error "OTRACE_HEAP_SHARDS is gone: the live table is no longer sharded. Size it with OTRACE_HEAP_TABLE_BUCKETS."
+#endif
+#ifndef OTRACE_HEAP_TABLE_BUCKETS
+#define OTRACE_HEAP_TABLE_BUCKETS 65536
+#endif
+
+#ifndef OTRACE_HEAP_MAX_SITES
+#define OTRACE_HEAP_MAX_SITES 4096
+#endif
+
+#ifndef OTRACE_HEAP_MAX_SNAPSHOTS
+#define OTRACE_HEAP_MAX_SNAPSHOTS 16
+#endif
+
+#ifndef OTRACE_HEAP_PEAK_MIN_BYTES
+#define OTRACE_HEAP_PEAK_MIN_BYTES (1u << 20)
+#endif
+
+#ifndef OTRACE_HEAP_MAX_NAMED
+#define OTRACE_HEAP_MAX_NAMED 32
+#endif
+
+#ifndef OTRACE_HEAP_STACK_FRAMES
+#define OTRACE_HEAP_STACK_FRAMES 1
+#endif
+
+#ifndef OTRACE_MAX_STACK_FRAMES
+#define OTRACE_MAX_STACK_FRAMES 65536
+#endif
+
+#ifndef OTRACE_HEAP_ASYNC
+#define OTRACE_HEAP_ASYNC 0
+#endif
+
+#ifndef OTRACE_HEAP_ASYNC_RING
+#define OTRACE_HEAP_ASYNC_RING 16384
 #endif
 
 #ifndef OTRACE_HEAP_STACKS
 #define OTRACE_HEAP_STACKS 0
 #endif
+
+#ifndef OTRACE_HEAP_FP_UNWIND
+#define OTRACE_HEAP_FP_UNWIND 0
+#endif
+
+#ifndef OTRACE_HEAP_SCOPES
+#define OTRACE_HEAP_SCOPES 1
+#endif
 #ifndef OTRACE_HEAP_DEMANGLE
 #define OTRACE_HEAP_DEMANGLE 0
 #endif
+#ifndef OTRACE_HEAP_SYMBOLIZE
+#define OTRACE_HEAP_SYMBOLIZE 1
+#endif
+#ifndef OTRACE_HEAP_DEBUG_DIR
+#define OTRACE_HEAP_DEBUG_DIR "/usr/lib/debug"
+#endif
 #ifndef OTRACE_HEAP_DBGHELP
 #define OTRACE_HEAP_DBGHELP 0
 #endif
 
+#ifndef OTRACE_COUNTER_DOWNSAMPLE
+#define OTRACE_COUNTER_DOWNSAMPLE ""  // e.g. "*=5000" to cap every counter row at ~5000 points
+#endif
+
+#ifndef OTRACE_COALESCE_GAP_US
+#define OTRACE_COALESCE_GAP_US 0   // 0 disables coalescing of repeated events
+#endif
+#ifndef OTRACE_COALESCE_MAX_US
+#define OTRACE_COALESCE_MAX_US 0   // 0 = no per-slice duration limit
+#endif
+
+#ifndef OTRACE_SCOPE_STATS
+#define OTRACE_SCOPE_STATS 0
+#endif
+#ifndef OTRACE_SCOPE_STATS_SLOTS
+#define OTRACE_SCOPE_STATS_SLOTS 512
+#endif
+
+
+// ---- Query types (available even when OTRACE == 0) -------------------------
+// Kept outside the OTRACE gate so code reading live statistics compiles either
+// way; with tracing off the query macros just clear the output vector.
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace otrace {
+
+#define OTRACE_STATS_BUCKETS 32   // log2 duration buckets: [0], [1,2), [2,4) ... us
+
+// Aggregate for one scope name/category, merged over all threads.
+struct ScopeStat {
+  std::string name;
+  std::string cat;
+  uint64_t count = 0;
+  uint64_t total_us = 0;
+  uint64_t min_us = 0;
+  uint64_t max_us = 0;
+  uint64_t hist[OTRACE_STATS_BUCKETS] = {};
+
+  double mean_us() const { return count ? (double)total_us / (double)count : 0.0; }
+
+  // Quantile estimate (q in 0..1), linear inside the matching log2 bucket and
+  // clamped to [min_us, max_us].
+  double percentile_us(double q) const {
+    if (!count) return 0.0;
+    if (q < 0.0) q = 0.0;
+    if (q > 1.0) q = 1.0;
+    const double want = q * (double)count;
+    uint64_t cum = 0;
+    for (int b = 0; b < OTRACE_STATS_BUCKETS; ++b) {
+      if (!hist[b]) continue;
+      if ((double)(cum + hist[b]) >= want) {
+        const double lo = b ? (double)(1ull << (b - 1)) : 0.0;
+        const double hi = b ? (double)(1ull << b) : 1.0;
+        double v = lo + (hi - lo) * ((want - (double)cum) / (double)hist[b]);
+        if (v < (double)min_us) v = (double)min_us;
+        if (v > (double)max_us) v = (double)max_us;
+        return v;
+      }
+      cum += hist[b];
+    }
+    return (double)max_us;
+  }
+};
+
+// Where one consumer of OTRACE_SCOPE_STATS_DELTA left off. Each consumer
+// (an exporter, a health check) owns its own, so they don't split deltas.
+struct ScopeStatsCursor {
+  std::map<std::pair<std::string, std::string>, ScopeStat> last;
+};
+
+// Last value of one counter name (all series), merged over all threads.
+struct CounterStat {
+  std::string name;
+  std::string cat;
+  std::vector<std::string> keys;    // series names
+  std::vector<double> values;       // last value per series
+  uint64_t ts_us = 0;               // timestamp of the last update
+  uint64_t updates = 0;             // number of samples recorded
+};
+
+} // namespace otrace
+
 
 // Public Macros (no-ops when OTRACE == 0)
 #if OTRACE
@@ -241,6 +443,31 @@
   #include <unistd.h>
   #include <sys/stat.h>  
 #endif
+#if OTRACE_HEAP && !defined(_WIN32)
+  #include <sys/mman.h>
+#endif
+#if OTRACE_HEAP && OTRACE_DEFINE_HEAP_HOOKS && OTRACE_HEAP_HOOK_MALLOC
+  #if !(defined(__linux__) && defined(__GLIBC__))
+    #error "OTRACE_HEAP_HOOK_MALLOC requires Linux with glibc"
+  #endif
+  #include <malloc.h>
+#endif
+#if !defined(_WIN32)
+  #include <fcntl.h>
+  #include <sys/resource.h>          // getrusage() for the memory sampler
+#endif
+// mallinfo2() appeared in glibc 2.33 (mallinfo() overflows past 4 GiB)
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  #include <malloc.h>
+  #define OTRACE_HAVE_MALLINFO2 1
+#else
+  #define OTRACE_HAVE_MALLINFO2 0
+#endif
+#if OTRACE_SCOPE_STATS && !defined(_WIN32)
+  #include <poll.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+#endif
 
 #include <cerrno>
 #if OTRACE_CLOCK==2 && (defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64))
@@ -287,6 +514,34 @@
   #define OTRACE_HAVE_EXECINFO  0
 #endif
 
+// Pin down which frames captured heap stacks start with (see heap::kHookFrames)
+#if defined(_MSC_VER)
+  #define OTRACE_NOINLINE     __declspec(noinline)
+  #define OTRACE_FORCE_INLINE __forceinline
+#else
+  #define OTRACE_NOINLINE     __attribute__((noinline))
+  #define OTRACE_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+// Frame-pointer walk: frame record is {previous fp, return address} on these
+#if OTRACE_HEAP && OTRACE_HEAP_STACKS && OTRACE_HEAP_FP_UNWIND && defined(__linux__) && \
+    (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__aarch64__))
+  #include <pthread.h>               // pthread_getattr_np() for stack bounds
+  #define OTRACE_HAVE_FP_UNWIND 1
+#else
+  #define OTRACE_HAVE_FP_UNWIND 0
+#endif
+
+// In-process ELF/DWARF symbolizer for report-time stack names (Linux)
+#if OTRACE_HEAP && OTRACE_HEAP_STACKS && OTRACE_HEAP_SYMBOLIZE && defined(__linux__) && \
+    __has_include(<link.h>) && __has_include(<elf.h>)
+  #include <link.h>                  // dl_iterate_phdr(), ElfW()
+  #include <elf.h>
+  #define OTRACE_HAVE_ELF_SYMBOLIZER 1
+#else
+  #define OTRACE_HAVE_ELF_SYMBOLIZER 0
+#endif
+
 // ================= Optional: demangling (heap tracer) ================
 #if OTRACE_HEAP && OTRACE_HEAP_DEMANGLE && __has_include(<cxxabi.h>)
   #include <cxxabi.h>            // abi::__cxa_demangle
@@ -320,6 +575,10 @@ inline void emit_instant_kvs(const char* name, const char* cat, KVs&&... kvs);
 
 inline void emit_counter_n(const char* name, const char* cat, int n,
                            const char** keys, const double* vals);
+// Instant that references an entry of the stackFrames dictionary (0 = none)
+template <typename... KVs>
+inline void emit_instant_sf(uint32_t sf, const char* name, const char* cat, KVs&&... kvs);
+inline uint32_t intern_stack_frame(uint32_t parent, const char* name, const char* cat);
 
 inline uint32_t pid() {
 #if defined(_WIN32)
@@ -478,23 +737,358 @@ struct AllocEntry {
     size_t size;
     uint64_t stack_hash;
     uint64_t timestamp;
+    float weight;           // allocations this sample stands for (0 = unsampled)
+    uint32_t heap;          // 0 = the system heap (hooks), else a registered named heap
 };
 
-// Callsite statistics
+// Lifetime histogram: bucket 0 is < 1 us, bucket k is [2^(k-1), 2^k) us, and
+// the last bucket is open-ended (~67 s and up).
+constexpr int kLifeBuckets = 28;
+
+inline int life_bucket(uint64_t us) {
+    int b = 0;
+    while (us && b < kLifeBuckets - 1) { us >>= 1; ++b; }
+    return b;
+}
+
+// Callsite statistics merged across threads at report time (raw PCs only)
 struct CallsiteStats {
-    uint64_t total_bytes;
+    uint64_t total_bytes;   // sampled
     uint64_t alloc_count;
+    double est_bytes;       // scaled by sample weights: unbiased estimate of all allocations
+    double est_count;
     uint64_t live_bytes;
     uint64_t live_count;
-    std::string sample_stack;
+    double est_live_bytes;  // est_bytes less the weighted frees
+    double est_live_count;
+    uint64_t life[kLifeBuckets];   // lifetimes of freed samples
+    uint64_t freed_1ms;            // freed samples that lived < 1 ms
+    uint32_t heap;                 // named heap the site allocates from (0 = system)
+    int depth;
+    void* frames[OTRACE_HEAP_STACK_DEPTH];
+};
+
+// Zeroed pages straight from the OS; never goes through malloc/new, so the
+// hooks can rely on it without recursing into themselves.
+inline void* os_alloc(size_t bytes) {
+#if defined(_WIN32)
+    return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+#endif
+}
+
+inline void os_free(void* p, size_t bytes) {
+#if defined(_WIN32)
+    (void)bytes;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, bytes);
+#endif
+}
+
+// Live allocation table: fixed-size buckets of a few slots each, chained into
+// an overflow pool when a bucket fills. The pool grows in segments mapped
+// straight from the OS (never malloc), up to kMaxSegments; only past that are
+// inserts dropped. Each bucket has its own spinlock (held for a handful of
+// compares), and frees that hash to an empty bucket never take it.
+static_assert((OTRACE_HEAP_TABLE_BUCKETS & (OTRACE_HEAP_TABLE_BUCKETS - 1)) == 0,
+              "OTRACE_HEAP_TABLE_BUCKETS must be a power of two");
+
+struct LiveSlot {
+    void* ptr;              // nullptr = free slot
+    AllocEntry e;
+};
+
+struct LiveBucket {
+    static constexpr int kSlots = 8;
+    std::atomic<uint32_t> lock;
+    std::atomic<uint32_t> used;     // occupied slots in this bucket's whole chain
+    uint32_t next;                  // 1-based overflow bucket index, 0 = end of chain
+    uint32_t pad;
+    LiveSlot slots[kSlots];
+};
+
+struct LiveTable {
+    static constexpr uint32_t kBuckets  = OTRACE_HEAP_TABLE_BUCKETS;
+    static constexpr uint32_t kOverflow = OTRACE_HEAP_TABLE_BUCKETS / 4 ? OTRACE_HEAP_TABLE_BUCKETS / 4 : 1;   // per segment
+    static constexpr uint32_t kMaxSegments = 1024;
+
+    LiveBucket* buckets  = nullptr;
+    std::atomic<LiveBucket*> overflow[kMaxSegments] = {};
+    std::atomic<uint32_t> overflow_next{0};
+    std::atomic<uint64_t> dropped{0};   // inserts refused because every segment is in use
+
+    LiveTable() {
+        buckets = (LiveBucket*)os_alloc(sizeof(LiveBucket) * kBuckets);
+        overflow[0].store((LiveBucket*)os_alloc(sizeof(LiveBucket) * kOverflow), std::memory_order_release);
+    }
+
+    // Overflow bucket `idx`, mapping its segment on first use (nullptr if the OS refuses)
+    LiveBucket* overflow_bucket(uint32_t idx) {
+        std::atomic<LiveBucket*>& seg = overflow[idx / kOverflow];
+        LiveBucket* base = seg.load(std::memory_order_acquire);
+        if (!base) {
+            LiveBucket* fresh = (LiveBucket*)os_alloc(sizeof(LiveBucket) * kOverflow);
+            if (!fresh) return nullptr;
+            if (seg.compare_exchange_strong(base, fresh, std::memory_order_acq_rel)) base = fresh;
+            else os_free(fresh, sizeof(LiveBucket) * kOverflow);   // another thread won
+        }
+        return &base[idx % kOverflow];
+    }
+
+    struct Lock {
+        LiveBucket& b;
+        explicit Lock(LiveBucket& b_) : b(b_) {
+            for (int spins = 0;; ++spins) {
+                if (!b.lock.load(std::memory_order_relaxed) &&
+                    !b.lock.exchange(1, std::memory_order_acquire)) return;
+                if (spins > 64) std::this_thread::yield();
+            }
+        }
+        ~Lock() { b.lock.store(0, std::memory_order_release); }
+    };
+
+    LiveBucket& head(void* ptr) {
+        uint64_t h = (uint64_t)reinterpret_cast<uintptr_t>(ptr) * 0x9E3779B97F4A7C15ull;
+        return buckets[(h >> 32) & (kBuckets - 1)];
+    }
+    LiveBucket* follow(const LiveBucket* b) {
+        if (!b->next) return nullptr;
+        const uint32_t idx = b->next - 1;
+        return &overflow[idx / kOverflow].load(std::memory_order_acquire)[idx % kOverflow];
+    }
+
+    // Insert or overwrite the entry for ptr. An overwrite means we missed the
+    // matching free; the stale entry is handed back so the caller can undo it.
+    bool insert(void* ptr, const AllocEntry& e, bool& replaced, AllocEntry& old) {
+        replaced = false;
+        if (!buckets) return false;
+        LiveBucket& h = head(ptr);
+        Lock lk(h);
+        LiveSlot* empty = nullptr;
+        LiveBucket* tail = &h;
+        for (LiveBucket* b = &h; b; tail = b, b = follow(b)) {
+            for (LiveSlot& s : b->slots) {
+                if (s.ptr == ptr && s.e.heap == e.heap) { old = s.e; s.e = e; replaced = true; return true; }
+                if (!s.ptr && !empty) empty = &s;
+            }
+        }
+        if (!empty) {
+            const uint32_t cap = kOverflow * kMaxSegments;
+            const uint32_t idx = overflow_next.load(std::memory_order_relaxed) < cap
+                                 ? overflow_next.fetch_add(1, std::memory_order_relaxed) : cap;
+            LiveBucket* ob = idx < cap ? overflow_bucket(idx) : nullptr;
+            if (!ob) { dropped.fetch_add(1, std::memory_order_relaxed); return false; }
+            tail->next = idx + 1;
+            empty = &ob->slots[0];
+        }
+        empty->ptr = ptr;
+        empty->e = e;
+        h.used.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    // Entries are keyed by (ptr, heap): a pool object may share its address
+    // with the malloc'd chunk it was carved from.
+    bool erase(void* ptr, uint32_t heap, AllocEntry& out) {
+        if (!buckets) return false;
+        LiveBucket& h = head(ptr);
+        if (h.used.load(std::memory_order_acquire) == 0) return false;
+        Lock lk(h);
+        for (LiveBucket* b = &h; b; b = follow(b)) {
+            for (LiveSlot& s : b->slots) {
+                if (s.ptr == ptr && s.e.heap == heap) {
+                    out = s.e;
+                    s.ptr = nullptr;
+                    h.used.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Visits every live entry, one bucket chain locked at a time.
+    template <class Fn> void for_each(Fn&& fn) {
+        if (!buckets) return;
+        for (uint32_t i = 0; i < kBuckets; ++i) {
+            LiveBucket& h = buckets[i];
+            if (h.used.load(std::memory_order_acquire) == 0) continue;
+            Lock lk(h);
+            for (LiveBucket* b = &h; b; b = follow(b))
+                for (const LiveSlot& s : b->slots)
+                    if (s.ptr) fn(s.ptr, s.e);
+        }
+    }
+
+    // Empties every slot; overflow buckets stay linked to their chains.
+    void clear() {
+        if (!buckets) return;
+        for (uint32_t i = 0; i < kBuckets; ++i) {
+            LiveBucket& h = buckets[i];
+            if (h.used.load(std::memory_order_acquire) == 0) continue;
+            Lock lk(h);
+            for (LiveBucket* b = &h; b; b = follow(b))
+                for (LiveSlot& s : b->slots) s.ptr = nullptr;
+            h.used.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Per-thread callsite accumulators. Each thread owns one table and is its
+// only writer; the report sums every table, including those of threads that
+// have exited, so sampled allocations and frees share no lock. A free is
+// charged to the freeing thread's table and live totals fall out of the sum.
+static_assert((OTRACE_HEAP_MAX_SITES & (OTRACE_HEAP_MAX_SITES - 1)) == 0,
+              "OTRACE_HEAP_MAX_SITES must be a power of two");
+
+struct SiteSlot {
+    std::atomic<uint64_t> hash;          // 0 = empty
+    std::atomic<uint64_t> alloc_bytes;
+    std::atomic<uint64_t> alloc_count;
+    std::atomic<uint64_t> free_bytes;
+    std::atomic<uint64_t> free_count;
+    std::atomic<double> est_bytes;
+    std::atomic<double> est_count;
+    std::atomic<double> est_free_bytes;
+    std::atomic<double> est_free_count;
+    std::atomic<uint64_t> life[kLifeBuckets];
+    std::atomic<uint64_t> freed_1ms;
+    uint32_t heap;                       // written with frames
+    std::atomic<int> depth;              // published after frames; 0 if only frees seen
+    void* frames[OTRACE_HEAP_STACK_DEPTH];
+};
+
+// Size classes: <=16 B, <=32 B, ... doubling up to <=64 MiB, then one for larger
+constexpr int kSizeClasses = 24;
+
+inline int size_class(size_t n) {
+    int c = 0;
+    for (size_t lim = 16; n > lim && c < kSizeClasses - 1; lim <<= 1) ++c;
+    return c;
+}
+
+// "<=64B", "<=4K", ">64M"
+inline void size_class_label(int c, char* buf, size_t cap) {
+    if (c >= kSizeClasses - 1) { std::snprintf(buf, cap, ">%lluM", (unsigned long long)((16ull << (c - 1)) >> 20)); return; }
+    const unsigned long long lim = 16ull << c;
+    if (lim >= (1ull << 20))      std::snprintf(buf, cap, "<=%lluM", lim >> 20);
+    else if (lim >= (1ull << 10)) std::snprintf(buf, cap, "<=%lluK", lim >> 10);
+    else                          std::snprintf(buf, cap, "<=%lluB", lim);
+}
+
+struct SiteTable {
+    SiteTable* next;                     // global list; tables are never unlinked
+    std::atomic<bool> in_use;            // owned by a live thread
+    std::atomic<uint32_t> tid;           // current (or last) owner
+    std::atomic<uint64_t> dropped;       // updates for sites past OTRACE_HEAP_MAX_SITES
+    // Every allocation/free on this thread by size class (not just samples)
+    std::atomic<uint64_t> class_allocs[kSizeClasses];
+    std::atomic<uint64_t> class_alloc_bytes[kSizeClasses];
+    std::atomic<uint64_t> class_frees[kSizeClasses];
+    std::atomic<uint64_t> class_free_bytes[kSizeClasses];
+    SiteSlot slots[OTRACE_HEAP_MAX_SITES];
+};
+
+#if OTRACE_HEAP_SCOPES
+// Per-thread allocation totals by scope, keyed by the name/category pointers
+// (one slot per callsite literal). Same ownership rules as SiteTable.
+constexpr uint32_t kScopeAllocSlots = 256;
+
+struct ScopeAllocSlot {
+    std::atomic<const char*> name;       // key; published after cat
+    const char* cat;
+    std::atomic<uint64_t> calls;         // scope instances that allocated
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> bytes;
+};
+
+struct ScopeAllocTable {
+    ScopeAllocTable* next;
+    std::atomic<bool> in_use;
+    std::atomic<uint64_t> dropped;
+    ScopeAllocSlot slots[kScopeAllocSlots];
+};
+
+// One open TRACE_SCOPE; lives inside the Scope object on the stack
+struct ScopeAlloc {
+    ScopeAlloc* parent;
+    uint64_t count;
+    uint64_t bytes;
+};
+#endif
+
+// Allocators outside the hooks (arenas, pools) report through a registered
+// heap id. Their bytes are kept apart from the system totals, since the
+// memory they carve up usually came from malloc and is already counted there.
+struct NamedHeap {
+    char name[32];
+    std::atomic<uint64_t> live_bytes;
+    std::atomic<uint64_t> live_count;
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> alloc_bytes;
+    std::atomic<uint64_t> peak_bytes;
+};
+
+// Age buckets for live allocations: up to kAgeThresholds boundaries, in
+// seconds; anything past the last one counts as old
+constexpr int kAgeThresholds = 4;
+
+// Estimated live bytes/count per site at one point in time; no AllocEntry
+// copies, just the merged site counters
+struct SnapshotSite {
+    double bytes;
+    double count;
 };
 
-// Shard for lock reduction
-struct Shard {
-    std::unordered_map<void*, AllocEntry> allocations;
-    std::mutex mutex;
+struct Snapshot {
+    std::string name;
+    uint64_t ts;
+    std::unordered_map<uint64_t, SnapshotSite> sites;
 };
 
+#if OTRACE_HEAP_ASYNC
+static_assert((OTRACE_HEAP_ASYNC_RING & (OTRACE_HEAP_ASYNC_RING - 1)) == 0,
+              "OTRACE_HEAP_ASYNC_RING must be a power of two");
+
+// One hook call, as logged for the consumer thread. The logs are merged on
+// `key`, so an address freed on one thread and reused on another replays in
+// order; `sites` is the logging thread's table, which the consumer updates.
+struct AsyncRecord {
+    uint64_t key;                        // steady clock, ns
+    uint64_t ts;
+    void* ptr;
+    uint64_t size;
+    uint64_t stack_hash;
+    SiteTable* sites;
+    float weight;
+    uint32_t heap;
+    uint8_t op;                          // kAsyncAlloc / kAsyncFree
+};
+enum : uint8_t { kAsyncAlloc = 1, kAsyncFree = 2 };
+
+// Per-thread SPSC log; same ownership rules as SiteTable
+struct AsyncLog {
+    AsyncLog* next;
+    std::atomic<bool> in_use;
+    alignas(64) std::atomic<uint64_t> head;       // consumer
+    uint64_t seen;                                // consumer only: tail when the round began
+    alignas(64) std::atomic<uint64_t> tail;       // producer
+    AsyncRecord recs[OTRACE_HEAP_ASYNC_RING];
+};
+#endif
+
+// Single-writer counter bump: no RMW needed, readers just see a recent value
+inline void bump(std::atomic<uint64_t>& c, uint64_t v) {
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+inline void bump(std::atomic<double>& c, double v) {
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
 // Global state
 struct State {
     std::atomic<uint64_t> live_bytes{0};
@@ -502,13 +1096,53 @@ struct State {
     std::atomic<uint64_t> total_frees{0};
     std::atomic<bool> enabled{false};
     std::atomic<double> sample_rate{OTRACE_HEAP_SAMPLE};
+    std::atomic<uint64_t> sample_bytes{(uint64_t)OTRACE_HEAP_SAMPLE_BYTES};
     
-    Shard shards[OTRACE_HEAP_SHARDS];
-    std::unordered_map<uint64_t, CallsiteStats> callsites;
-    std::mutex callsites_mutex;
+    LiveTable live;
+    std::atomic<SiteTable*> site_tables{nullptr};
+#if OTRACE_HEAP_SCOPES
+    std::atomic<ScopeAllocTable*> scope_tables{nullptr};
+#endif
     
+    std::mutex snapshot_mu;
+    std::vector<Snapshot> snapshots;           // oldest first, at most OTRACE_HEAP_MAX_SNAPSHOTS
+    std::atomic<double> age_thresholds[kAgeThresholds]{ {1.0}, {10.0}, {60.0}, {600.0} };
+    std::atomic<int> age_threshold_count{kAgeThresholds};
+
+    // High-water mark, and the site breakdown taken when live bytes last
+    // passed the previous snapshot's level by peak_margin (under snapshot_mu).
+    // The hooks only raise peak_snapshot_due; a tracer thread takes it.
+    std::atomic<uint64_t> peak_bytes{0};
+    std::atomic<uint64_t> peak_ts{0};
+    std::atomic<uint64_t> peak_snapshot_bytes{0};
+    std::atomic<bool> peak_snapshot_due{false};
+    std::atomic<double> peak_margin{0.10};
+    Snapshot peak_snapshot;
+
     std::atomic<uint64_t> last_counter_update{0};
     uint64_t counter_update_interval{1000000}; // 1 second in microseconds
+
+    // Named heaps: ids 1..named_count index named[id - 1]; never unregistered
+    std::mutex named_mu;
+    std::atomic<uint32_t> named_count{0};
+    NamedHeap named[OTRACE_HEAP_MAX_NAMED];
+
+#if OTRACE_HEAP_ASYNC
+    // Async mode: hooks log, async_thr applies. A record is reflected in the
+    // tables once its log's head has passed it.
+    std::atomic<bool> async_on{false};
+    std::atomic<bool> async_stop{false};
+    std::atomic<bool> async_live{false};          // async_thr is still replaying
+    std::atomic<AsyncLog*> async_logs{nullptr};
+    std::thread async_thr;
+#endif
+
+    // Timeline sampler (background thread); while it runs, the hooks emit no counters
+    std::atomic<bool> timeline_on{false};
+    std::atomic<bool> timeline_stop{false};
+    std::thread timeline_thr;
+    uint32_t timeline_ms = 1000;
+    uint32_t timeline_top = 8;
 };
     
 
@@ -517,6 +1151,247 @@ inline State& state() {
     return s;
 }
 
+// Reuse a table left behind by an exited thread, or map a new one. Tables
+// are only summed, so adopting one keeps its counts intact.
+template <class T>
+inline T* acquire_table(std::atomic<T*>& head) {
+    for (T* t = head.load(std::memory_order_acquire); t; t = t->next) {
+        bool idle = false;
+        if (t->in_use.compare_exchange_strong(idle, true, std::memory_order_acq_rel)) return t;
+    }
+    T* t = (T*)os_alloc(sizeof(T));
+    if (!t) return nullptr;
+    t->in_use.store(true, std::memory_order_relaxed);
+    t->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(t->next, t, std::memory_order_release,
+                                       std::memory_order_relaxed)) {}
+    return t;
+}
+
+inline thread_local SiteTable* tls_sites = nullptr;
+#if OTRACE_HEAP_SCOPES
+inline thread_local ScopeAllocTable* tls_scope_allocs = nullptr;
+inline thread_local ScopeAlloc* tls_scope = nullptr;   // innermost open scope
+#endif
+inline thread_local bool tls_sites_retired = false;
+#if OTRACE_HEAP_ASYNC
+inline thread_local AsyncLog* tls_async_log = nullptr;
+inline thread_local bool tls_async_settled = false;   // see async_settle()
+#endif
+
+struct SiteTableOwner {
+    ~SiteTableOwner() {
+        tls_sites_retired = true;   // frees during later TLS teardown go uncounted
+        if (tls_sites) tls_sites->in_use.store(false, std::memory_order_release);
+        tls_sites = nullptr;
+#if OTRACE_HEAP_ASYNC
+        if (tls_async_log) tls_async_log->in_use.store(false, std::memory_order_release);   // consumer still drains it
+        tls_async_log = nullptr;
+#endif
+#if OTRACE_HEAP_SCOPES
+        if (tls_scope_allocs) tls_scope_allocs->in_use.store(false, std::memory_order_release);
+        tls_scope_allocs = nullptr;
+#endif
+    }
+};
+
+// Hands this thread's tables back at thread exit; false once that happened
+inline bool thread_tables_live() {
+    if (tls_sites_retired) return false;
+    thread_local SiteTableOwner owner;
+    (void)owner;
+    return true;
+}
+
+// This thread's slot for a stack hash, created on first use
+inline SiteTable* thread_sites() {
+    if (!tls_sites && thread_tables_live()) {
+        tls_sites = acquire_table(state().site_tables);
+        if (tls_sites) tls_sites->tid.store(otrace::tid(), std::memory_order_relaxed);
+    }
+    return tls_sites;
+}
+
+// The slot for a site in `t`. Slots are claimed with a CAS: in async mode the
+// consumer adds sites to the tables of the threads whose records it applies.
+inline SiteSlot* table_site(SiteTable* t, uint64_t hash) {
+    if (!t) return nullptr;
+    const uint32_t mask = OTRACE_HEAP_MAX_SITES - 1;
+    uint32_t i = (uint32_t)(hash ^ (hash >> 32)) & mask;
+    for (uint32_t n = 0; n <= mask; ++n, i = (i + 1) & mask) {
+        SiteSlot& slot = t->slots[i];
+        uint64_t h = slot.hash.load(std::memory_order_relaxed);
+        if (h == 0 && slot.hash.compare_exchange_strong(h, hash, std::memory_order_release,
+                                                        std::memory_order_relaxed)) return &slot;
+        if (h == hash) return &slot;
+    }
+    t->dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+inline SiteSlot* thread_site(uint64_t hash) { return table_site(thread_sites(), hash); }
+
+#if OTRACE_HEAP_SCOPES
+// This thread's slot for a scope callsite, created on first use
+inline ScopeAllocSlot* thread_scope_slot(const char* name, const char* cat) {
+    if (!tls_scope_allocs) {
+        if (!thread_tables_live()) return nullptr;
+        tls_scope_allocs = acquire_table(state().scope_tables);
+        if (!tls_scope_allocs) return nullptr;
+    }
+    const uint32_t mask = kScopeAllocSlots - 1;
+    uint64_t h = ((uint64_t)(uintptr_t)name ^ ((uint64_t)(uintptr_t)cat << 1)) * 0x9E3779B97F4A7C15ull;
+    uint32_t i = (uint32_t)(h >> 32) & mask;
+    for (uint32_t n = 0; n <= mask; ++n, i = (i + 1) & mask) {
+        ScopeAllocSlot& slot = tls_scope_allocs->slots[i];
+        const char* k = slot.name.load(std::memory_order_relaxed);
+        if (k == name && slot.cat == cat) return &slot;
+        if (!k) {
+            slot.cat = cat;
+            slot.name.store(name, std::memory_order_release);
+            return &slot;
+        }
+    }
+    bump(tls_scope_allocs->dropped, 1);
+    return nullptr;
+}
+
+inline void scope_push(ScopeAlloc& s) {
+    s.parent = tls_scope;
+    s.count = 0;
+    s.bytes = 0;
+    tls_scope = &s;
+}
+
+// Closing a scope folds its totals into the parent, so each scope reports
+// what it allocated including everything its nested scopes did.
+inline void scope_pop(ScopeAlloc& s, const char* name, const char* cat) {
+    tls_scope = s.parent;
+    if (!s.count) return;
+    if (s.parent) { s.parent->count += s.count; s.parent->bytes += s.bytes; }
+    if (ScopeAllocSlot* slot = thread_scope_slot(name, cat)) {
+        bump(slot->calls, 1);
+        bump(slot->count, s.count);
+        bump(slot->bytes, s.bytes);
+    }
+}
+#endif
+
+// Zero every table in place (tables stay owned by their threads). Meant for
+// enable(true) at the start of a run; counts racing with it may be lost.
+inline void reset_sites() {
+    for (SiteTable* t = state().site_tables.load(std::memory_order_acquire); t; t = t->next) {
+        t->dropped.store(0, std::memory_order_relaxed);
+        for (int c = 0; c < kSizeClasses; ++c) {
+            t->class_allocs[c].store(0, std::memory_order_relaxed);
+            t->class_alloc_bytes[c].store(0, std::memory_order_relaxed);
+            t->class_frees[c].store(0, std::memory_order_relaxed);
+            t->class_free_bytes[c].store(0, std::memory_order_relaxed);
+        }
+        for (SiteSlot& slot : t->slots) {
+            if (!slot.hash.load(std::memory_order_relaxed)) continue;
+            slot.depth.store(0, std::memory_order_relaxed);
+            slot.alloc_bytes.store(0, std::memory_order_relaxed);
+            slot.alloc_count.store(0, std::memory_order_relaxed);
+            slot.free_bytes.store(0, std::memory_order_relaxed);
+            slot.free_count.store(0, std::memory_order_relaxed);
+            slot.est_bytes.store(0, std::memory_order_relaxed);
+            slot.est_count.store(0, std::memory_order_relaxed);
+            slot.est_free_bytes.store(0, std::memory_order_relaxed);
+            slot.est_free_count.store(0, std::memory_order_relaxed);
+            for (auto& b : slot.life) b.store(0, std::memory_order_relaxed);
+            slot.freed_1ms.store(0, std::memory_order_relaxed);
+            slot.hash.store(0, std::memory_order_release);
+        }
+    }
+#if OTRACE_HEAP_SCOPES
+    for (ScopeAllocTable* t = state().scope_tables.load(std::memory_order_acquire); t; t = t->next) {
+        t->dropped.store(0, std::memory_order_relaxed);
+        for (ScopeAllocSlot& slot : t->slots) {   // keys stay; they are callsite literals
+            slot.calls.store(0, std::memory_order_relaxed);
+            slot.count.store(0, std::memory_order_relaxed);
+            slot.bytes.store(0, std::memory_order_relaxed);
+        }
+    }
+#endif
+}
+
+// Size-class totals over every thread's table
+struct SizeClassTotals {
+    uint64_t allocs[kSizeClasses] = {};
+    uint64_t alloc_bytes[kSizeClasses] = {};
+    uint64_t live[kSizeClasses] = {};
+    uint64_t live_bytes[kSizeClasses] = {};
+};
+
+inline void merge_size_classes(SizeClassTotals& out) {
+    out = SizeClassTotals{};
+    for (SiteTable* t = state().site_tables.load(std::memory_order_acquire); t; t = t->next) {
+        for (int c = 0; c < kSizeClasses; ++c) {
+            const uint64_t a  = t->class_allocs[c].load(std::memory_order_relaxed);
+            const uint64_t ab = t->class_alloc_bytes[c].load(std::memory_order_relaxed);
+            out.allocs[c]      += a;
+            out.alloc_bytes[c] += ab;
+            out.live[c]        += a - t->class_frees[c].load(std::memory_order_relaxed);
+            out.live_bytes[c]  += ab - t->class_free_bytes[c].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Sum every thread's table into one entry per stack hash
+inline std::unordered_map<uint64_t, CallsiteStats> merge_sites(uint64_t* dropped = nullptr) {
+    std::unordered_map<uint64_t, CallsiteStats> out;
+    if (dropped) *dropped = 0;
+    for (SiteTable* t = state().site_tables.load(std::memory_order_acquire); t; t = t->next) {
+        if (dropped) *dropped += t->dropped.load(std::memory_order_relaxed);
+        for (const SiteSlot& slot : t->slots) {
+            const uint64_t h = slot.hash.load(std::memory_order_acquire);
+            if (!h) continue;
+            const uint64_t ab = slot.alloc_bytes.load(std::memory_order_relaxed);
+            const uint64_t ac = slot.alloc_count.load(std::memory_order_relaxed);
+            const uint64_t fb = slot.free_bytes.load(std::memory_order_relaxed);
+            const uint64_t fc = slot.free_count.load(std::memory_order_relaxed);
+            CallsiteStats& cs = out[h];
+            cs.total_bytes += ab;
+            cs.alloc_count += ac;
+            cs.live_bytes  += ab - fb;   // wraps per table, exact once summed
+            cs.live_count  += ac - fc;
+            cs.est_bytes   += slot.est_bytes.load(std::memory_order_relaxed);
+            cs.est_count   += slot.est_count.load(std::memory_order_relaxed);
+            cs.est_live_bytes += slot.est_bytes.load(std::memory_order_relaxed) -
+                                 slot.est_free_bytes.load(std::memory_order_relaxed);
+            cs.est_live_count += slot.est_count.load(std::memory_order_relaxed) -
+                                 slot.est_free_count.load(std::memory_order_relaxed);
+            for (int b = 0; b < kLifeBuckets; ++b) cs.life[b] += slot.life[b].load(std::memory_order_relaxed);
+            cs.freed_1ms   += slot.freed_1ms.load(std::memory_order_relaxed);
+            const int d = slot.depth.load(std::memory_order_acquire);
+            if (d > 0 && cs.depth == 0) {
+                cs.heap = slot.heap;
+                cs.depth = d;
+                std::memcpy(cs.frames, slot.frames, sizeof(void*) * (size_t)d);
+            }
+        }
+    }
+    // Frees seen for a site that was never sampled on any thread
+    for (auto it = out.begin(); it != out.end();) {
+        if (it->second.alloc_count == 0) it = out.erase(it); else ++it;
+    }
+    return out;
+}
+
+// Per-site estimated live totals right now, from the site tables alone
+inline Snapshot take_snapshot(const char* name,
+                              const std::unordered_map<uint64_t, CallsiteStats>& callsites) {
+    Snapshot snap{name ? name : "", ::otrace::now_us(), {}};
+    snap.sites.reserve(callsites.size());
+    for (const auto& kv : callsites) {
+        const double bytes = std::max(0.0, kv.second.est_live_bytes);
+        const double count = std::max(0.0, kv.second.est_live_count);
+        if (bytes > 0.0 || count > 0.0) snap.sites.emplace(kv.first, SnapshotSite{bytes, count});
+    }
+    return snap;
+}
+
 // Thread-local reentrancy guard for heap hooks
 inline thread_local bool tls_in_heap_hook = false;
 
@@ -542,7 +1417,60 @@ inline uint64_t hash_stack(void** stack, int depth) {
     return hash;
 }
 
-inline int capture_stack(void** buffer, int max_depth) {
+#if OTRACE_HAVE_FP_UNWIND
+// This thread's stack range, looked up once per thread
+inline bool thread_stack_bounds(uintptr_t& lo, uintptr_t& hi) {
+  thread_local uintptr_t t_lo = 0, t_hi = 0;
+  thread_local bool t_done = false;
+  if (!t_done) {
+    t_done = true;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+      void* addr = nullptr; size_t size = 0;
+      if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        t_lo = (uintptr_t)addr;
+        t_hi = t_lo + size;
+      }
+      pthread_attr_destroy(&attr);
+    }
+  }
+  lo = t_lo; hi = t_hi;
+  return t_hi != 0;
+}
+
+// Follows saved frame pointers; every frame must lie above the previous one
+// and inside this thread's stack, so a frame without a pointer ends the walk
+// instead of faulting. Same frame numbering as backtrace(): [0] is the caller.
+__attribute__((noinline)) inline int fp_unwind(void** buffer, int max_depth) {
+  uintptr_t lo, hi;
+  if (!thread_stack_bounds(lo, hi)) return -1;
+  uintptr_t fp = (uintptr_t)__builtin_frame_address(0);
+  int n = 0;
+  while (n < max_depth) {
+    if (fp < lo || fp > hi - 2 * sizeof(void*) || (fp & (sizeof(void*) - 1))) break;
+    const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+    if (!frame[1]) break;
+    buffer[n++] = reinterpret_cast<void*>(frame[1]);
+    if (frame[0] <= fp) break;
+    fp = frame[0];
+  }
+  return n;
+}
+#endif
+
+// Innermost frames of a hook's captured stack that belong to the tracer:
+// record_alloc (kept out of line) and the hook (operator new, malloc, ...)
+// that called it. Named heaps drop only record_alloc: heap_alloc is always
+// inlined into the allocator that reports through it.
+constexpr int kHookFrames = 2;
+
+OTRACE_FORCE_INLINE int capture_stack(void** buffer, int max_depth) {   // its frame must not count
+#if OTRACE_HAVE_FP_UNWIND
+  // A caller built without frame pointers ends the walk right after its own
+  // return address, one frame past the hooks; let the unwinder try then.
+  int n = fp_unwind(buffer, max_depth);
+  if (n > kHookFrames + 1) return n;
+#endif
 #if OTRACE_HAVE_EXECINFO
   return backtrace(buffer, max_depth);
 #elif defined(_WIN32) && OTRACE_HAVE_DBGHELP
@@ -576,80 +1504,930 @@ inline std::string format_frame(const char* symbol) {
     return frame;
 }
 
-// Format stack trace
-inline std::string format_stack(void** stack, int depth) {
-    std::string result;
-#if defined(__linux__) || defined(__APPLE__)
-    char** symbols = backtrace_symbols(stack, depth);
-    if (symbols) {
-        for (int i = 2; i < depth && symbols[i]; ++i) { // Skip first two frames (heap functions)
-            if (i > 2) result += " <- ";
-            result += format_frame(symbols[i]);
+// "libfoo.so+0x1a2b" from "/usr/lib/libfoo.so(+0x1a2b) [0x7f...]"; "" if no module
+inline std::string module_offset(const char* symbol) {
+    const std::string frame(symbol);
+    const size_t open = frame.find('('), close = frame.find(')', open);
+    if (open == std::string::npos || close == std::string::npos || open == 0) return std::string();
+    std::string module = frame.substr(0, open);
+    const size_t slash = module.rfind('/');
+    if (slash != std::string::npos) module.erase(0, slash + 1);
+    return module + frame.substr(open + 1, close - open - 1);
+}
+
+// Report-time symbol for one return address
+struct FrameSymbol {
+    std::string func;   // from symbolize: module+offset or the raw pc when unknown
+    std::string file;   // source file basename, empty without line info
+    uint32_t line = 0;
+};
+
+#if OTRACE_HAVE_ELF_SYMBOLIZER
+// In-process ELF/DWARF symbolizer. Modules come from dl_iterate_phdr; each
+// file is mapped read-only on first use (plus its separate debug file, found
+// by build-id or .gnu_debuglink under OTRACE_HEAP_DEBUG_DIR) and stays mapped.
+// Names come from .symtab, or .dynsym when the file is stripped, so
+// -rdynamic is not needed; file:line comes from .debug_line (DWARF 2-5).
+// Inlined frames report the line inside the inlinee under the outer function.
+namespace elf {
+
+struct Bytes { const uint8_t* p = nullptr; size_t n = 0; };
+
+struct Image {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    std::vector<std::vector<uint8_t>> inflated;   // decompressed SHF_COMPRESSED sections
+
+    bool load(const char* path) {
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        void* m = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ElfW(Ehdr)))
+            m = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) return false;
+        const ElfW(Ehdr)* eh = (const ElfW(Ehdr)*)m;
+        const bool ok = std::memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0 &&
+                        eh->e_ident[EI_CLASS] == (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32) &&
+                        eh->e_shentsize == sizeof(ElfW(Shdr)) &&
+                        eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(ElfW(Shdr)) <= (uint64_t)st.st_size;
+        if (!ok) { ::munmap(m, (size_t)st.st_size); return false; }
+        data = (const uint8_t*)m;
+        size = (size_t)st.st_size;
+        return true;
+    }
+    const ElfW(Ehdr)* ehdr() const { return (const ElfW(Ehdr)*)data; }
+    const ElfW(Shdr)* shdr(size_t i) const {
+        return i < ehdr()->e_shnum ? (const ElfW(Shdr)*)(data + ehdr()->e_shoff) + i : nullptr;
+    }
+    const ElfW(Shdr)* section(const char* name) const {
+        if (!data) return nullptr;
+        const ElfW(Shdr)* names = shdr(ehdr()->e_shstrndx);
+        if (!names || names->sh_offset + names->sh_size > size) return nullptr;
+        for (size_t i = 0; i < ehdr()->e_shnum; ++i) {
+            const ElfW(Shdr)* s = shdr(i);
+            if (s->sh_name < names->sh_size &&
+                std::strncmp((const char*)data + names->sh_offset + s->sh_name, name, names->sh_size - s->sh_name) == 0)
+                return s;
+        }
+        return nullptr;
+    }
+    Bytes bytes(const ElfW(Shdr)* s) {
+        Bytes b;
+        if (!s || s->sh_type == SHT_NOBITS || s->sh_offset + s->sh_size > size) return b;
+        b.p = data + s->sh_offset;
+        b.n = (size_t)s->sh_size;
+        if (!(s->sh_flags & SHF_COMPRESSED)) return b;
+#if OTRACE_USE_ZLIB || OTRACE_USE_MINIZ
+        ElfW(Chdr) ch;
+        if (b.n < sizeof(ch)) return Bytes();
+        std::memcpy(&ch, b.p, sizeof(ch));
+        if (ch.ch_type != ELFCOMPRESS_ZLIB) return Bytes();
+        std::vector<uint8_t> out((size_t)ch.ch_size);
+        uLongf out_n = (uLongf)out.size();
+        if (uncompress(out.data(), &out_n, b.p + sizeof(ch), (uLong)(b.n - sizeof(ch))) != Z_OK) return Bytes();
+        inflated.push_back(std::move(out));
+        return Bytes{ inflated.back().data(), (size_t)out_n };
+#else
+        return Bytes();   // needs zlib/miniz
+#endif
+    }
+};
+
+// Bounds-checked reader; running off the end sets `bad` and yields zeros
+struct Cursor {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool bad = false;
+
+    Cursor(const uint8_t* b, const uint8_t* e) : p(b), end(e) {}
+    bool more() const { return !bad && p < end; }
+    void skip(uint64_t n) { if (n > (uint64_t)(end - p)) { bad = true; p = end; } else p += n; }
+    uint64_t fixed(size_t n) {
+        uint64_t v = 0;
+        if (n > (size_t)(end - p)) { bad = true; p = end; return 0; }
+        std::memcpy(&v, p, n);   // DWARF is target-endian; we only read our own process
+        p += n;
+        return v;
+    }
+    uint64_t uleb() {
+        uint64_t v = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (p >= end) { bad = true; return 0; }
+            const uint8_t b = *p++;
+            if (shift < 64) v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+    }
+    int64_t sleb() {
+        int64_t v = 0;
+        int shift = 0;
+        uint8_t b = 0;
+        do {
+            if (p >= end) { bad = true; return 0; }
+            b = *p++;
+            if (shift < 64) v |= (int64_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        if (shift < 64 && (b & 0x40)) v |= -((int64_t)1 << shift);
+        return v;
+    }
+    const char* cstr() {
+        const uint8_t* s = p;
+        while (p < end && *p) ++p;
+        if (p >= end) { bad = true; return ""; }
+        ++p;
+        return (const char*)s;
+    }
+};
+
+struct Module {
+    std::string path;
+    uintptr_t bias = 0;                                   // runtime = link-time address + bias
+    std::vector<std::pair<uintptr_t, uintptr_t>> ranges;  // runtime [lo, hi) of PT_LOAD segments
+    bool loaded = false;
+    Image file, debug;
+
+    struct Sym { uintptr_t addr, size; const char* name; };
+    std::vector<Sym> syms;                                // sorted by addr
+    struct Row { uintptr_t addr; uint32_t file, line; };  // line 0 = no info (end of sequence)
+    std::vector<Row> rows;                                // sorted by addr
+    std::vector<std::string> files{ std::string() };      // 0 = unknown
+
+    bool contains(uintptr_t pc) const {
+        for (const auto& r : ranges) if (pc >= r.first && pc < r.second) return true;
+        return false;
+    }
+};
+
+inline std::string base_name(const char* path) {
+    const char* slash = std::strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+inline void read_symbols(Module& m, Image& img, uint32_t type) {
+    for (size_t i = 0; img.data && i < img.ehdr()->e_shnum; ++i) {
+        const ElfW(Shdr)* s = img.shdr(i);
+        if (s->sh_type != type || s->sh_entsize != sizeof(ElfW(Sym))) continue;
+        const ElfW(Shdr)* strs = img.shdr(s->sh_link);
+        const Bytes syms = img.bytes(s);
+        const Bytes names = img.bytes(strs);
+        if (!syms.p || !names.p) continue;
+        for (size_t k = 0; k + sizeof(ElfW(Sym)) <= syms.n; k += sizeof(ElfW(Sym))) {
+            const ElfW(Sym)* sym = (const ElfW(Sym)*)(syms.p + k);
+            const unsigned kind = sym->st_info & 0xf;
+            if ((kind != STT_FUNC && kind != STT_GNU_IFUNC) || sym->st_shndx == SHN_UNDEF ||
+                !sym->st_value || sym->st_name >= names.n)
+                continue;
+            m.syms.push_back({ (uintptr_t)sym->st_value, (uintptr_t)sym->st_size, (const char*)names.p + sym->st_name });
+        }
+    }
+}
+
+// Reads one DW_FORM value of a v5 directory/file entry; sets `str` for string forms
+inline bool read_form(Cursor& c, uint64_t form, bool dwarf64, const Bytes& str, const Bytes& line_str, const char*& out) {
+    auto strp = [&](const Bytes& sec) {
+        const uint64_t off = c.fixed(dwarf64 ? 8 : 4);
+        if (off < sec.n) out = (const char*)sec.p + off;
+    };
+    switch (form) {
+        case 0x08: out = c.cstr(); return true;                 // string
+        case 0x0e: strp(str); return true;                      // strp
+        case 0x1f: strp(line_str); return true;                 // line_strp
+        case 0x0b: c.skip(1); return true;                      // data1
+        case 0x05: c.skip(2); return true;                      // data2
+        case 0x06: c.skip(4); return true;                      // data4
+        case 0x07: c.skip(8); return true;                      // data8
+        case 0x1e: c.skip(16); return true;                     // data16 (MD5)
+        case 0x0f: case 0x1a: c.uleb(); return true;            // udata, strx (unresolved)
+        case 0x0d: c.sleb(); return true;                       // sdata
+        case 0x09: c.skip(c.uleb()); return true;               // block
+        case 0x0a: c.skip(c.fixed(1)); return true;             // block1
+        case 0x03: c.skip(c.fixed(2)); return true;             // block2
+        case 0x04: c.skip(c.fixed(4)); return true;             // block4
+        case 0x25: c.skip(1); return true;                      // strx1..4
+        case 0x26: c.skip(2); return true;
+        case 0x27: c.skip(3); return true;
+        case 0x28: c.skip(4); return true;
+        default: return false;
+    }
+}
+
+// Decodes every line program in .debug_line into m.rows (file basename + line)
+inline void read_lines(Module& m, Image& img) {
+    const Bytes sec = img.bytes(img.section(".debug_line"));
+    const Bytes str = img.bytes(img.section(".debug_str"));
+    const Bytes line_str = img.bytes(img.section(".debug_line_str"));
+    std::unordered_map<std::string, uint32_t> file_ids;
+    auto intern = [&](const char* path) -> uint32_t {
+        std::string name = base_name(path ? path : "");
+        if (name.empty()) return 0;
+        auto it = file_ids.find(name);
+        if (it != file_ids.end()) return it->second;
+        m.files.push_back(name);
+        return file_ids[name] = (uint32_t)m.files.size() - 1;
+    };
+
+    Cursor c(sec.p, sec.p + sec.n);
+    while (c.more()) {
+        uint64_t len = c.fixed(4);
+        const bool dwarf64 = len == 0xffffffffu;
+        if (dwarf64) len = c.fixed(8);
+        if (c.bad || len > (uint64_t)(c.end - c.p)) break;
+        const uint8_t* unit_end = c.p + len;
+        Cursor u(c.p, unit_end);
+        c.p = unit_end;
+
+        const unsigned version = (unsigned)u.fixed(2);
+        if (version < 2 || version > 5) continue;
+        size_t addr_size = sizeof(void*);
+        if (version >= 5) { addr_size = (size_t)u.fixed(1); u.skip(1); }
+        const uint64_t header_len = u.fixed(dwarf64 ? 8 : 4);
+        if (u.bad || header_len > (uint64_t)(unit_end - u.p)) continue;
+        const uint8_t* program = u.p + header_len;
+        const unsigned min_inst = (unsigned)u.fixed(1);
+        if (version >= 4) u.skip(1);                            // maximum_operations_per_instruction
+        u.skip(1);                                              // default_is_stmt
+        const int line_base = (int8_t)u.fixed(1);
+        const unsigned line_range = (unsigned)u.fixed(1);
+        const unsigned opcode_base = (unsigned)u.fixed(1);
+        std::vector<uint8_t> op_args(opcode_base ? opcode_base - 1 : 0);
+        for (uint8_t& n : op_args) n = (uint8_t)u.fixed(1);
+        if (u.bad || line_range == 0 || opcode_base == 0) continue;
+
+        std::vector<uint32_t> fmap;                             // unit file index -> m.files
+        if (version < 5) {
+            fmap.push_back(0);                                  // file indices start at 1
+            while (u.more() && *u.cstr()) {}                    // include_directories
+            while (u.more()) {
+                const char* name = u.cstr();
+                if (!*name) break;
+                u.uleb(); u.uleb(); u.uleb();                   // dir, mtime, length
+                fmap.push_back(intern(name));
+            }
+        } else {
+            bool ok = true;
+            for (int table = 0; table < 2 && ok; ++table) {     // directories, then files
+                const unsigned nfmt = (unsigned)u.fixed(1);
+                std::vector<std::pair<uint64_t, uint64_t>> fmt(nfmt);
+                for (auto& f : fmt) { f.first = u.uleb(); f.second = u.uleb(); }
+                const uint64_t count = u.uleb();
+                for (uint64_t i = 0; i < count && ok && !u.bad; ++i) {
+                    const char* path = nullptr;
+                    for (const auto& f : fmt) {
+                        const char* s = nullptr;
+                        ok = ok && read_form(u, f.second, dwarf64, str, line_str, s);
+                        if (f.first == 1) path = s;             // DW_LNCT_path
+                    }
+                    if (table == 1) fmap.push_back(intern(path));
+                }
+            }
+            if (!ok || u.bad) continue;
+        }
+
+        Cursor p(program, unit_end);
+        uintptr_t addr = 0;
+        uint64_t file = 1;
+        int64_t line = 1;
+        size_t seq_start = m.rows.size();
+        auto row = [&]() {
+            const uint32_t f = file < fmap.size() ? fmap[file] : 0;
+            const uint32_t l = line > 0 ? (uint32_t)line : 0;
+            if (m.rows.size() > seq_start && m.rows.back().file == f && m.rows.back().line == l) return;
+            m.rows.push_back({ addr, f, l });
+        };
+        while (p.more()) {
+            const unsigned op = (unsigned)p.fixed(1);
+            if (op >= opcode_base) {                            // special opcode
+                const unsigned adj = op - opcode_base;
+                addr += (uintptr_t)(adj / line_range) * min_inst;
+                line += line_base + (int)(adj % line_range);
+                row();
+                continue;
+            }
+            switch (op) {
+                case 0: {                                       // extended
+                    const uint64_t n = p.uleb();
+                    if (n == 0 || n > (uint64_t)(p.end - p.p)) { p.bad = true; break; }
+                    const uint8_t* next = p.p + n;
+                    const unsigned sub = (unsigned)p.fixed(1);
+                    if (sub == 1) {                             // end_sequence
+                        m.rows.push_back({ addr, 0, 0 });
+                        addr = 0; file = 1; line = 1;
+                        seq_start = m.rows.size();
+                    } else if (sub == 2) {                      // set_address
+                        addr = (uintptr_t)p.fixed(std::min<size_t>(addr_size, (size_t)n - 1));
+                    }
+                    p.p = next;
+                    break;
+                }
+                case 1: row(); break;                                        // copy
+                case 2: addr += (uintptr_t)p.uleb() * min_inst; break;       // advance_pc
+                case 3: line += p.sleb(); break;                             // advance_line
+                case 4: file = p.uleb(); break;                              // set_file
+                case 8: addr += (uintptr_t)((255 - opcode_base) / line_range) * min_inst; break;   // const_add_pc
+                case 9: addr += (uintptr_t)p.fixed(2); break;                // fixed_advance_pc
+                default:
+                    for (unsigned i = 0; i < op_args[op - 1]; ++i) p.uleb();
+                    break;
+            }
+        }
+    }
+    // Sequence ends sort before rows starting at the same address
+    std::stable_sort(m.rows.begin(), m.rows.end(), [](const Module::Row& a, const Module::Row& b) {
+        return a.addr < b.addr || (a.addr == b.addr && (a.file | a.line) == 0 && (b.file | b.line) != 0);
+    });
+}
+
+// Separate debug file: /usr/lib/debug/.build-id/xx/yyyy.debug, then the
+// .gnu_debuglink name next to the file, in .debug/, and under the debug root
+inline bool load_debug_file(Module& m) {
+    if (const ElfW(Shdr)* note = m.file.section(".note.gnu.build-id")) {
+        const Bytes b = m.file.bytes(note);
+        if (b.n > 12) {
+            uint32_t namesz, descsz, type;
+            std::memcpy(&namesz, b.p, 4);
+            std::memcpy(&descsz, b.p + 4, 4);
+            std::memcpy(&type, b.p + 8, 4);
+            const size_t desc = 12 + ((namesz + 3u) & ~3u);
+            if (type == NT_GNU_BUILD_ID && descsz > 1 && desc + descsz <= b.n) {
+                std::string path = OTRACE_HEAP_DEBUG_DIR "/.build-id/";
+                char hex[3];
+                for (uint32_t i = 0; i < descsz; ++i) {
+                    std::snprintf(hex, sizeof(hex), "%02x", b.p[desc + i]);
+                    path += hex;
+                    if (i == 0) path += '/';
+                }
+                path += ".debug";
+                if (m.debug.load(path.c_str())) return true;
+            }
+        }
+    }
+    if (const ElfW(Shdr)* link = m.file.section(".gnu_debuglink")) {
+        const Bytes b = m.file.bytes(link);
+        if (b.n && std::memchr(b.p, 0, b.n)) {
+            const std::string name = (const char*)b.p;
+            const size_t slash = m.path.rfind('/');
+            const std::string dir = slash == std::string::npos ? std::string(".") : m.path.substr(0, slash);
+            const std::string candidates[] = {
+                dir + "/" + name, dir + "/.debug/" + name, std::string(OTRACE_HEAP_DEBUG_DIR) + dir + "/" + name };
+            for (const std::string& path : candidates)
+                if (path != m.path && m.debug.load(path.c_str())) return true;
+        }
+    }
+    return false;
+}
+
+inline void load_module(Module& m) {
+    m.loaded = true;
+    if (!m.file.load(m.path.c_str())) return;
+    const bool has_symtab = m.file.section(".symtab") != nullptr;
+    const bool has_lines = m.file.section(".debug_line") != nullptr;
+    if (!has_symtab || !has_lines) load_debug_file(m);
+
+    if (has_symtab) read_symbols(m, m.file, SHT_SYMTAB);
+    else if (m.debug.section(".symtab")) read_symbols(m, m.debug, SHT_SYMTAB);
+    if (m.syms.empty()) read_symbols(m, m.file, SHT_DYNSYM);
+    std::sort(m.syms.begin(), m.syms.end(), [](const Module::Sym& a, const Module::Sym& b) { return a.addr < b.addr; });
+
+    read_lines(m, has_lines ? m.file : m.debug);
+}
+
+// Loaded modules; never destroyed, since reports can run from exit handlers
+struct Modules {
+    std::vector<Module*> list;
+};
+inline Modules& modules() { static Modules* ms = new Modules(); return *ms; }
+
+// Adds modules loaded since the last call (dl_iterate_phdr order, main first)
+inline void refresh_modules() {
+    struct Seen { std::string path; uintptr_t bias; std::vector<std::pair<uintptr_t, uintptr_t>> ranges; };
+    std::vector<Seen> seen;
+    dl_iterate_phdr([](struct dl_phdr_info* info, size_t, void* arg) -> int {
+        Seen s{ info->dlpi_name ? info->dlpi_name : "", (uintptr_t)info->dlpi_addr, {} };
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+            if (ph.p_type == PT_LOAD)
+                s.ranges.emplace_back(s.bias + ph.p_vaddr, s.bias + ph.p_vaddr + ph.p_memsz);
+        }
+        ((std::vector<Seen>*)arg)->push_back(std::move(s));
+        return 0;
+    }, &seen);
+    for (Seen& s : seen) {
+        if (s.path.empty()) {                               // main executable
+            char exe[4096];
+            const ssize_t n = ::readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+            if (n <= 0) continue;
+            s.path.assign(exe, (size_t)n);
+        }
+        bool known = false;
+        for (const Module* m : modules().list) known = known || (m->bias == s.bias && m->path == s.path);
+        if (known) continue;
+        Module* m = new Module();
+        m->path = std::move(s.path);
+        m->bias = s.bias;
+        m->ranges = std::move(s.ranges);
+        modules().list.push_back(m);
+    }
+}
+
+// Caller holds the symbol cache lock
+inline bool lookup(uintptr_t pc, FrameSymbol& out) {
+    Module* mod = nullptr;
+    for (int pass = 0; pass < 2 && !mod; ++pass) {
+        if (pass) refresh_modules();
+        for (Module* m : modules().list) if (m->contains(pc)) { mod = m; break; }
+    }
+    if (!mod) return false;
+    if (!mod->loaded) load_module(*mod);
+
+    const uintptr_t addr = pc - mod->bias;
+    auto s = std::upper_bound(mod->syms.begin(), mod->syms.end(), addr,
+                              [](uintptr_t a, const Module::Sym& sym) { return a < sym.addr; });
+    if (s != mod->syms.begin() && (--s, s->size == 0 || addr < s->addr + s->size))
+        out.func = demangle(s->name);
+    auto r = std::upper_bound(mod->rows.begin(), mod->rows.end(), addr,
+                              [](uintptr_t a, const Module::Row& row) { return a < row.addr; });
+    if (r != mod->rows.begin() && (--r)->line) {
+        out.file = mod->files[r->file];
+        out.line = r->line;
+    }
+    return !out.func.empty() || out.line;
+}
+
+} // namespace elf
+#endif
+
+// Per-PC symbol cache; never destroyed, since reports can run from exit handlers
+struct SymbolCache {
+    std::mutex mu;
+    std::unordered_map<void*, FrameSymbol> pcs;
+};
+inline SymbolCache& symbol_cache() { static SymbolCache* c = new SymbolCache(); return *c; }
+
+// Symbolizes a captured return address (looked up at pc-1, the call site).
+// Falls back to backtrace_symbols() when the ELF reader finds nothing.
+// Report time only: this maps files and allocates.
+inline FrameSymbol symbolize(void* pc) {
+    otrace::TracerGuard _tg;
+    SymbolCache& c = symbol_cache();
+    std::lock_guard<std::mutex> lk(c.mu);
+    auto it = c.pcs.find(pc);
+    if (it != c.pcs.end()) return it->second;
+    FrameSymbol s;
+    bool found = false;
+#if OTRACE_HAVE_ELF_SYMBOLIZER
+    found = pc && elf::lookup((uintptr_t)pc - 1, s);
+#endif
+#if OTRACE_HAVE_EXECINFO
+    if (!found) {
+        if (char** symbols = backtrace_symbols(&pc, 1)) {
+            if (symbols[0]) {
+                s.func = format_frame(symbols[0]);
+                if (s.func.empty()) s.func = module_offset(symbols[0]);   // "lib.so(+0x...)"
+            }
+            free(symbols);
         }
-        free(symbols);
     }
 #endif
+    (void)found;
+    if (s.func.empty() && !s.line) {   // never leave a blank frame in a stack
+        char raw[24];
+        std::snprintf(raw, sizeof(raw), "%p", pc);
+        s.func = raw;
+    }
+    return c.pcs.emplace(pc, std::move(s)).first->second;
+}
+
+// "func file.cpp:42", "func" or "file.cpp:42"
+inline std::string frame_label(const FrameSymbol& s) {
+    std::string out = s.func;
+    if (s.line) {
+        if (!out.empty()) out += ' ';
+        out += s.file.empty() ? std::string("?") : s.file;
+        out += ':';
+        out += std::to_string(s.line);
+    }
+    return out;
+}
+
+inline std::vector<std::string> frame_names(void* const* pcs, int depth) {
+    std::vector<std::string> names((size_t)std::max(depth, 0));
+    for (int i = 0; i < depth; ++i) names[i] = frame_label(symbolize(pcs[i]));
+    return names;
+}
+
+// Format stack trace (report time only: symbolization allocates)
+inline std::string format_stack(void* const* stack, int depth) {
+    std::string result;
+    const std::vector<std::string> names = frame_names(stack, depth);
+    for (size_t i = 0; i < names.size(); ++i) {   // hook frames were dropped at capture
+        if (i > 0) result += " <- ";
+        result += names[i];
+    }
     return result;
 }
 
-// Get shard for a pointer
-inline Shard& get_shard(void* ptr) {
-    uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
-    return state().shards[p % OTRACE_HEAP_SHARDS];
+// How a site appears in report args. With OTRACE_HEAP_STACK_FRAMES the stack
+// goes into the trace's stackFrames dictionary (root first, so shared
+// prefixes share ids) and the text is just the innermost frame; otherwise
+// the text is the whole stack. Named-heap sites are prefixed "[name] ".
+struct SiteLabel {
+    std::string text;
+    uint32_t sf;   // leaf stackFrames id, 0 = none
+};
+
+inline SiteLabel site_label(const CallsiteStats& cs) {
+    SiteLabel out{std::string(), 0};
+    const char* heap_name = cs.heap ? state().named[cs.heap - 1].name : nullptr;
+#if OTRACE_HEAP_STACK_FRAMES
+    const std::vector<std::string> names = frame_names(cs.frames, cs.depth);
+    for (int i = cs.depth - 1; i >= 0; --i)   // frames are innermost first
+        out.sf = ::otrace::intern_stack_frame(out.sf, names[i].c_str(), heap_name ? heap_name : "heap");
+    if (cs.depth > 0) out.text = names[0];
+#else
+    out.text = format_stack(cs.frames, cs.depth);
+#endif
+    if (heap_name) out.text = "[" + std::string(heap_name) + "] " + out.text;
+    return out;
+}
+
+// Undo the live accounting for an entry leaving the table
+// (`freed` is false when a stale entry is overwritten: no real lifetime then;
+// `at` is when the free happened, 0 = now; `sites` is the freeing thread's table)
+inline void release_entry(const AllocEntry& e, bool freed = true, uint64_t at = 0,
+                          SiteTable* sites = thread_sites()) {
+    if (e.heap) {
+        NamedHeap& nh = state().named[e.heap - 1];
+        nh.live_bytes.fetch_sub(e.size, std::memory_order_relaxed);
+        nh.live_count.fetch_sub(1, std::memory_order_relaxed);
+    } else {
+        state().live_bytes.fetch_sub(e.size, std::memory_order_relaxed);
+        if (SiteTable* t = sites) {
+            const int c = size_class(e.size);
+            bump(t->class_frees[c], 1);
+            bump(t->class_free_bytes[c], e.size);
+        }
+    }
+    if (e.stack_hash != 0) {
+        if (SiteSlot* slot = table_site(sites, e.stack_hash)) {
+            bump(slot->free_bytes, e.size);
+            bump(slot->free_count, 1);
+            bump(slot->est_free_bytes, (double)e.weight * (double)e.size);
+            bump(slot->est_free_count, (double)e.weight);
+            if (freed) {
+                const uint64_t now = at ? at : now_us();
+                const uint64_t lived = now > e.timestamp ? now - e.timestamp : 0;
+                bump(slot->life[life_bucket(lived)], 1);
+                if (lived < 1000) bump(slot->freed_1ms, 1);
+            }
+        }
+    }
+}
+
+// Tiny thread-local xorshift for sampling; uniform in [0, 1)
+inline double sample_uniform() {
+    thread_local uint64_t s = (uint64_t)otrace::tid() * 0x9E3779B97F4A7C15ull + now_us();
+    s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+    return (double)((s >> 11) & ((1ull<<53)-1)) / (double)(1ull<<53);
+}
+
+// Bytes until the next sample point, exponential with the given mean
+inline int64_t sample_interval(uint64_t mean) {
+    double gap = -std::log(1.0 - sample_uniform()) * (double)mean;
+    return gap < 9.0e18 ? (int64_t)gap : INT64_MAX;
+}
+
+// One counter track per size class seen so far: live bytes and allocation rate
+// since the previous emission (one caller at a time: the timeline thread, or
+// the allocating thread that won the periodic update).
+inline void emit_size_class_counters(uint64_t now, uint64_t last) {
+    static uint64_t prev_allocs[kSizeClasses];
+    SizeClassTotals tot;
+    merge_size_classes(tot);
+    const double secs = now > last && last ? (double)(now - last) / 1e6 : 0.0;
+    for (int c = 0; c < kSizeClasses; ++c) {
+        if (!tot.allocs[c]) continue;
+        char label[16], name[32];
+        size_class_label(c, label, sizeof(label));
+        std::snprintf(name, sizeof(name), "heap_size %s", label);
+        const char* k[] = { "live_bytes", "allocs_per_s" };
+        const double v[] = { (double)tot.live_bytes[c],
+                             secs > 0.0 && tot.allocs[c] >= prev_allocs[c]
+                                 ? (double)(tot.allocs[c] - prev_allocs[c]) / secs : 0.0 };
+        prev_allocs[c] = tot.allocs[c];
+        ::otrace::emit_counter_n(name, "heap", 2, k, v);
+    }
+}
+
+// Raise the high-water mark; past the margin, flag the per-site breakdown as
+// due (a walk of the site tables, so it happens O(log peak) times). Runs in
+// the hooks: no allocation, no lock.
+inline void record_peak(uint64_t live) {
+    State& S = state();
+    uint64_t peak = S.peak_bytes.load(std::memory_order_relaxed);
+    if (live <= peak) return;
+    while (live > peak && !S.peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+    if (live <= peak) return;
+    S.peak_ts.store(::otrace::now_us(), std::memory_order_relaxed);
+
+    uint64_t snapped = S.peak_snapshot_bytes.load(std::memory_order_relaxed);
+    const double margin = S.peak_margin.load(std::memory_order_relaxed);
+    const double due = std::max((double)OTRACE_HEAP_PEAK_MIN_BYTES, (double)snapped * (1.0 + margin));
+    if ((double)live < due) return;
+    if (!S.peak_snapshot_bytes.compare_exchange_strong(snapped, live, std::memory_order_relaxed)) return;
+    S.peak_snapshot_due.store(true, std::memory_order_release);
+}
+
+// Take a breakdown flagged by record_peak, if any. Called from the timeline
+// thread, the async consumer and the report, never from the hooks; `merged`
+// reuses a merge_sites() result the caller already has.
+inline void take_peak_snapshot(const std::unordered_map<uint64_t, CallsiteStats>* merged = nullptr) {
+    State& S = state();
+    if (!S.peak_snapshot_due.load(std::memory_order_relaxed)) return;
+    if (!S.peak_snapshot_due.exchange(false, std::memory_order_acquire)) return;
+    otrace::TracerGuard _tg;
+    Snapshot snap = merged ? take_snapshot("peak", *merged) : take_snapshot("peak", merge_sites());
+    {
+        std::lock_guard<std::mutex> lk(S.snapshot_mu);
+        S.peak_snapshot = std::move(snap);
+    }
+    ::otrace::emit_instant_kvs("heap_peak_snapshot", "heap",
+                               "live_bytes", (double)S.live_bytes.load(std::memory_order_relaxed));
+}
+
+// Table and site updates for one allocation; the hook itself in sync mode,
+// the consumer thread in async mode. The caller has already counted it in
+// the size classes. Site updates go to `sites`, the allocating thread's
+// table, so the per-thread split is the same in both modes.
+inline void apply_alloc(void* ptr, size_t size, uint32_t heap, uint64_t stack_hash, double weight,
+                        uint64_t ts, SiteTable* sites) {
+    // If the table is full the allocation is counted as dropped and kept out
+    // of the live totals, since its free could never be matched.
+    bool replaced = false;
+    AllocEntry old;
+    if (!state().live.insert(ptr, {size, stack_hash, ts, (float)weight, heap}, replaced, old)) {
+        if (!heap) {
+            if (SiteTable* t = sites) {   // undo the size-class count
+                const int c = size_class(size);
+                bump(t->class_frees[c], 1);
+                bump(t->class_free_bytes[c], size);
+            }
+        }
+        return;
+    }
+    if (replaced) release_entry(old, false, 0, sites);
+    if (heap) {
+        NamedHeap& nh = state().named[heap - 1];
+        const uint64_t live = nh.live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        nh.live_count.fetch_add(1, std::memory_order_relaxed);
+        nh.allocs.fetch_add(1, std::memory_order_relaxed);
+        nh.alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+        uint64_t peak = nh.peak_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !nh.peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+    } else {
+        record_peak(state().live_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+    }
+    
+    // Update callsite stats if we have a stack
+    if (stack_hash != 0) {
+        if (SiteSlot* slot = table_site(sites, stack_hash)) {
+            bump(slot->alloc_bytes, size);
+            bump(slot->alloc_count, 1);
+            bump(slot->est_bytes, weight * (double)size);
+            bump(slot->est_count, weight);
+        }
+    }
+}
+
+inline void apply_free(void* ptr, uint32_t heap, uint64_t ts, SiteTable* sites) {
+    AllocEntry e;
+    if (!state().live.erase(ptr, heap, e)) return;
+    state().total_frees.fetch_add(1, std::memory_order_relaxed);
+    release_entry(e, true, ts, sites);
+}
+
+// One "heap <name>" counter track per registered heap
+inline void emit_named_heap_counters() {
+    const uint32_t n = state().named_count.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < n; ++i) {
+        const NamedHeap& nh = state().named[i];
+        char name[48];
+        std::snprintf(name, sizeof(name), "heap %s", nh.name);
+        const char* k[] = { "live_bytes", "live_allocs", "peak_bytes" };
+        const double v[] = { (double)nh.live_bytes.load(std::memory_order_relaxed),
+                             (double)nh.live_count.load(std::memory_order_relaxed),
+                             (double)nh.peak_bytes.load(std::memory_order_relaxed) };
+        ::otrace::emit_counter_n(name, "heap", 3, k, v);
+    }
+}
+
+#if OTRACE_HEAP_ASYNC
+// Merge key for the thread logs. The free of an address is logged before the
+// address is returned to the allocator, so whoever gets it next stamps a
+// later key: replaying in key order keeps free-then-reuse pairs in order.
+inline uint64_t async_key() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Replays the thread logs in key order. Each round reads every tail twice.
+// A record seen in the first pass can only depend on records visible by the
+// second, so first-pass records are applied up to the smallest key that
+// arrived in between; the rest wait for the next round.
+inline void async_loop() {
+  otrace::tls_in_tracer = true;   // nothing this thread allocates is logged
+  State& S = state();
+  constexpr uint64_t mask = OTRACE_HEAP_ASYNC_RING - 1;
+  using Head = std::pair<uint64_t, AsyncLog*>;
+  std::vector<Head> heads;   // min-heap on key, one entry per non-empty log
+  const auto later = [](const Head& a, const Head& b){ return a.first > b.first; };
+
+  for (;;) {
+    const bool stopping = S.async_stop.load(std::memory_order_acquire);
+    AsyncLog* const logs = S.async_logs.load(std::memory_order_acquire);
+    for (AsyncLog* l = logs; l; l = l->next) l->seen = l->tail.load(std::memory_order_acquire);
+    uint64_t water = ~0ull;
+    for (AsyncLog* l = logs; l; l = l->next) {
+      if (l->tail.load(std::memory_order_acquire) != l->seen) water = std::min(water, l->recs[l->seen & mask].key);
+      const uint64_t h = l->head.load(std::memory_order_relaxed);
+      if (h != l->seen) heads.push_back({l->recs[h & mask].key, l});
+    }
+    std::make_heap(heads.begin(), heads.end(), later);
+    size_t applied = 0;
+    while (!heads.empty() && heads.front().first < water) {
+      std::pop_heap(heads.begin(), heads.end(), later);
+      AsyncLog* l = heads.back().second;
+      heads.pop_back();
+      const uint64_t h = l->head.load(std::memory_order_relaxed);
+      const AsyncRecord r = l->recs[h & mask];
+      l->head.store(h + 1, std::memory_order_release);
+      if (r.op == kAsyncAlloc) apply_alloc(r.ptr, (size_t)r.size, r.heap, r.stack_hash, r.weight, r.ts, r.sites);
+      else                     apply_free(r.ptr, r.heap, r.ts, r.sites);
+      ++applied;
+      if (h + 1 != l->seen) {
+        heads.push_back({l->recs[(h + 1) & mask].key, l});
+        std::push_heap(heads.begin(), heads.end(), later);
+      }
+    }
+    const bool pending = !heads.empty() || water != ~0ull;
+    heads.clear();
+    take_peak_snapshot();
+    if (stopping && !pending) { S.async_live.store(false, std::memory_order_release); return; }
+    if (!applied) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// This thread's log, acquired on first use
+inline AsyncLog* thread_async_log() {
+  if (!tls_async_log && thread_tables_live()) tls_async_log = acquire_table(state().async_logs);
+  return tls_async_log;
+}
+
+inline void async_drain();
+
+// Before a thread applies records itself (async mode stopping, or its log
+// handed back at thread exit), wait until the consumer has replayed what was
+// logged so far: a direct free must not overtake its own alloc record, and
+// the consumer must be done with this thread's site table. Once per thread,
+// since such a thread does not log again.
+inline void async_settle() {
+  if (tls_async_settled || !state().async_live.load(std::memory_order_acquire)) return;
+  async_drain();
+  tls_async_settled = true;
+}
+
+// Append one record; false when async mode is off and the caller should
+// apply it directly. Waits (yielding) while this thread's log is full.
+inline bool async_log(uint8_t op, void* ptr, size_t size, uint32_t heap, uint64_t stack_hash, double weight) {
+  State& S = state();
+  AsyncLog* l = S.async_on.load(std::memory_order_relaxed) ? thread_async_log() : nullptr;
+  if (!l) { async_settle(); return false; }
+  const uint64_t t = l->tail.load(std::memory_order_relaxed);
+  while (t - l->head.load(std::memory_order_acquire) >= OTRACE_HEAP_ASYNC_RING) {
+    if (!S.async_on.load(std::memory_order_relaxed)) { async_settle(); return false; }
+    std::this_thread::yield();
+  }
+  AsyncRecord& r = l->recs[t & (OTRACE_HEAP_ASYNC_RING - 1)];
+  r.key = async_key();
+  r.ts = ::otrace::now_us();
+  r.ptr = ptr;
+  r.size = size;
+  r.stack_hash = stack_hash;
+  r.sites = thread_sites();
+  r.weight = (float)weight;
+  r.heap = heap;
+  r.op = op;
+  l->tail.store(t + 1, std::memory_order_release);
+  return true;
+}
+
+// Blocks until everything logged before the call is in the tables
+inline void async_drain() {
+  State& S = state();
+  for (AsyncLog* l = S.async_logs.load(std::memory_order_acquire); l; l = l->next) {
+    const uint64_t target = l->tail.load(std::memory_order_acquire);
+    while (S.async_live.load(std::memory_order_acquire) &&
+           l->head.load(std::memory_order_acquire) < target)
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+}
+
+inline void async_stop() {
+  State& S = state();
+  S.async_on.store(false, std::memory_order_release);   // hooks settle, then apply directly
+  S.async_stop.store(true, std::memory_order_release);
+  if (S.async_thr.joinable()) S.async_thr.join();
+}
+
+inline void async_start() {
+  State& S = state();
+  if (S.async_on.load(std::memory_order_acquire) || S.async_thr.joinable()) return;
+  static bool at_exit = (std::atexit(async_stop), true);   // join before statics go away
+  (void)at_exit;
+  otrace::TracerGuard _tg;
+  S.async_stop.store(false, std::memory_order_release);
+  S.async_live.store(true, std::memory_order_release);
+  S.async_thr = std::thread(async_loop);
+  S.async_on.store(true, std::memory_order_release);
 }
+#else
+inline void async_drain() {}
+#endif
 
-// Record allocation
-inline void record_alloc(void* ptr, size_t size) {
+// Record allocation (`heap` is a named heap id, 0 for the hooks; `skip` is
+// how many captured frames are the tracer's own)
+OTRACE_NOINLINE inline void record_alloc(void* ptr, size_t size, uint32_t heap = 0, int skip = kHookFrames) {
     if (!ptr) return;
     if (otrace::tls_in_tracer) return;
     HeapHookGuard guard;
     if (!guard.active) return;  // already inside the hook: skip
     if (!state().enabled.load(std::memory_order_relaxed)) return;
     
-    // Update global stats
-    state().live_bytes.fetch_add(size, std::memory_order_relaxed);
     state().total_allocations.fetch_add(1, std::memory_order_relaxed);
+#if OTRACE_HEAP_SCOPES
+    // Named heaps carve up memory that malloc already charged to the scope
+    if (ScopeAlloc* sc = heap ? nullptr : tls_scope) { sc->count += 1; sc->bytes += size; }
+#endif
     
-    // Sample stack if needed
+    // Sample stack if needed (raw PCs only; no symbolization in the hook)
     uint64_t stack_hash = 0;
-    std::string stack_str;
+    void* stack[OTRACE_HEAP_STACK_DEPTH];
+    int depth = 0;
+    double weight = 0.0;
+    const uint64_t mean = state().sample_bytes.load(std::memory_order_relaxed);
     double rate = state().sample_rate.load(std::memory_order_relaxed);
     
-    if (rate > 0.0) {
-        // Tiny thread-local xorshift for sampling
-        thread_local uint64_t s = (uint64_t)otrace::tid() * 0x9E3779B97F4A7C15ull + now_us();
-        s ^= s << 13; s ^= s >> 7; s ^= s << 17;
-        double u = (double)((s >> 11) & ((1ull<<53)-1)) / (double)(1ull<<53);
-        
-        if (u < rate) {
-            void* stack[OTRACE_HEAP_STACK_DEPTH];
-            int depth = capture_stack(stack, OTRACE_HEAP_STACK_DEPTH);
-            if (depth > 2) { // Skip heap functions
-                stack_hash = hash_stack(stack + 2, depth - 2);
-                stack_str = format_stack(stack + 2, depth - 2);
-            }
+    if (mean > 0) {
+        // Byte sampling: every byte is a sample point with probability 1/mean,
+        // so the gap to the next one is exponential and an allocation of
+        // `size` bytes is hit with probability 1 - exp(-size/mean).
+        thread_local int64_t until = -1;
+        if (until < 0) until = sample_interval(mean);
+        until -= (int64_t)size;
+        if (until < 0) {
+            weight = 1.0 / -std::expm1(-(double)size / (double)mean);
+            until = sample_interval(mean);
         }
+    } else if (rate > 0.0 && sample_uniform() < rate) {
+        weight = 1.0 / rate;
     }
     
-    // Store allocation
-    Shard& shard = get_shard(ptr);
-    std::lock_guard<std::mutex> lock(shard.mutex);
-    shard.allocations[ptr] = {size, stack_hash, now_us()};
+    if (weight > 0.0) {
+        depth = capture_stack(stack, OTRACE_HEAP_STACK_DEPTH);
+        if (depth > skip) {
+            stack_hash = hash_stack(stack + skip, depth - skip);
+            if (heap) stack_hash ^= (uint64_t)heap * 0x9E3779B97F4A7C15ull;   // sites are per heap
+        }
+    }
     
-    // Update callsite stats if we have a stack
-    if (stack_hash != 0) {
-        std::lock_guard<std::mutex> lock(state().callsites_mutex);
-        CallsiteStats& stats = state().callsites[stack_hash];
-        stats.total_bytes += size;
-        stats.alloc_count += 1;
-        stats.live_bytes += size;
-        stats.live_count += 1;
-        if (stats.sample_stack.empty() && !stack_str.empty()) {
-            stats.sample_stack = stack_str;
+    if (!stack_hash) weight = 0.0;
+    if (stack_hash != 0 && depth > skip) {
+        if (SiteSlot* slot = thread_site(stack_hash)) {
+            if (slot->depth.load(std::memory_order_relaxed) == 0) {
+                // first sample of this stack on this thread: keep its PCs
+                slot->heap = heap;
+                std::memcpy(slot->frames, stack + skip, sizeof(void*) * (size_t)(depth - skip));
+                slot->depth.store(depth - skip, std::memory_order_release);
+            }
+        }
+    }
+    if (!heap) {
+        if (SiteTable* t = thread_sites()) {
+            const int c = size_class(size);
+            bump(t->class_allocs[c], 1);
+            bump(t->class_alloc_bytes[c], size);
         }
     }
+
+#if OTRACE_HEAP_ASYNC
+    if (!async_log(kAsyncAlloc, ptr, size, heap, stack_hash, weight))
+#endif
+    apply_alloc(ptr, size, heap, stack_hash, weight, now_us(), thread_sites());
     
-    // Periodically update counter
+    // Periodically update counter (the timeline thread does this when running)
+if (state().timeline_on.load(std::memory_order_relaxed)) return;
 uint64_t now = ::otrace::now_us();
 uint64_t last = state().last_counter_update.load(std::memory_order_relaxed);
 if (now - last >= state().counter_update_interval) {
@@ -657,161 +2435,675 @@ if (now - last >= state().counter_update_interval) {
     const char* k[] = { "heap_live_bytes" };
     double v[] = { (double)state().live_bytes.load(std::memory_order_relaxed) };
     ::otrace::emit_counter_n("heap_live_bytes", nullptr, 1, k, v);
+    emit_size_class_counters(now, last);
+    emit_named_heap_counters();
   }
 }
 
         }
 
-// Record free
-inline void record_free(void* ptr) {
+// Record free (`heap` as for record_alloc)
+inline void record_free(void* ptr, uint32_t heap = 0) {
   if (!ptr) return;
   if (otrace::tls_in_tracer) return;   
   HeapHookGuard guard;
   if (!guard.active) return;  // already inside the hook: skip
   if (!state().enabled.load(std::memory_order_relaxed)) return;
-    Shard& shard = get_shard(ptr);
-    std::lock_guard<std::mutex> lock(shard.mutex);
-    auto it = shard.allocations.find(ptr);
-    if (it != shard.allocations.end()) {
-        // Update global stats
-        state().live_bytes.fetch_sub(it->second.size, std::memory_order_relaxed);
-        state().total_frees.fetch_add(1, std::memory_order_relaxed);
-        
-        // Update callsite stats if we have a stack
-        if (it->second.stack_hash != 0) {
-            std::lock_guard<std::mutex> lock(state().callsites_mutex);
-            auto cs_it = state().callsites.find(it->second.stack_hash);
-            if (cs_it != state().callsites.end()) {
-                cs_it->second.live_bytes -= it->second.size;
-                cs_it->second.live_count -= 1;
-            }
+#if OTRACE_HEAP_ASYNC
+  if (async_log(kAsyncFree, ptr, 0, heap, 0, 0.0)) return;
+#endif
+  apply_free(ptr, heap, 0, thread_sites());
+}
+
+// Generate heap report
+inline void generate_report() {
+  if (!state().enabled.load(std::memory_order_relaxed)) return;
+  otrace::TracerGuard _tg;   // the report's own allocations are not recorded
+  async_drain();
+
+  // Symbolize each unique stack once, on demand; stack_sf is valid after stack_text
+  std::unordered_map<uint64_t, SiteLabel> symbolized;
+  auto stack_text = [&](uint64_t hash, const CallsiteStats& cs) -> const std::string& {
+    auto it = symbolized.find(hash);
+    if (it == symbolized.end()) it = symbolized.emplace(hash, site_label(cs)).first;
+    return it->second.text;
+  };
+  auto stack_sf = [&](uint64_t hash) -> uint32_t {
+    auto it = symbolized.find(hash);
+    return it != symbolized.end() ? it->second.sf : 0;
+  };
+
+  ::otrace::emit_instant_kvs("heap_report_started", "heap", "status", "begin");
+
+  // 1) Snapshot live allocations and merge per-thread callsite tables
+  uint64_t dropped_sites = 0;
+  const std::unordered_map<uint64_t, CallsiteStats> callsites = merge_sites(&dropped_sites);
+  take_peak_snapshot(&callsites);
+  std::vector<std::pair<void*, AllocEntry>> all_allocs;
+  all_allocs.reserve(1024);
+  state().live.for_each([&](void* p, const AllocEntry& e) { all_allocs.emplace_back(p, e); });
+
+  // 2) Group by callsite hash
+  std::unordered_map<uint64_t, std::vector<std::pair<void*, AllocEntry>>> by_site;
+  for (const auto& p : all_allocs) {
+    by_site[p.second.stack_hash].push_back(p);
+  }
+
+  // 3) Sort sites by total bytes, each sample scaled by its weight so sampled
+  //    sites stand for the allocations they represent. Unsampled allocations
+  //    (hash 0) are what those weights already estimate, so they stay out of
+  //    the ranking and are reported once, raw, on their own line.
+  struct LeakTotal { uint64_t hash; double bytes; double count; bool scaled; };
+  std::vector<LeakTotal> leak_sizes;
+  leak_sizes.reserve(by_site.size());
+  uint64_t unsampled_bytes = 0, unsampled_count = 0;
+  for (const auto& kv : by_site) {
+    if (kv.first == 0) {
+      for (const auto& alloc : kv.second) unsampled_bytes += alloc.second.size;
+      unsampled_count = kv.second.size();
+      continue;
+    }
+    LeakTotal t{kv.first, 0.0, 0.0, false};
+    for (const auto& alloc : kv.second) {
+      const double w = alloc.second.weight > 0.0f ? (double)alloc.second.weight : 1.0;
+      t.bytes += w * (double)alloc.second.size;
+      t.count += w;
+      t.scaled = t.scaled || w != 1.0;
+    }
+    leak_sizes.push_back(t);
+  }
+  std::sort(leak_sizes.begin(), leak_sizes.end(),
+            [](const auto& a, const auto& b){ return a.bytes > b.bytes; });
+
+  // Totals as "(B bytes, N allocations)", noting how many samples an estimate rests on
+  auto totals_text = [](double bytes, double count, bool scaled, uint64_t samples) {
+    std::string t = " (" + std::to_string((unsigned long long)std::llround(bytes)) + " bytes, " +
+                    std::to_string((unsigned long long)std::llround(count)) + " allocations";
+    if (scaled) t += ", estimated from " + std::to_string(samples) + " samples";
+    return t + ")";
+  };
+
+  // 4) Emit summary stats (always)
+  {
+    const std::string live_cnt = std::to_string(all_allocs.size());
+    const std::string sites_cnt = std::to_string(by_site.size());
+    const std::string dropped   = std::to_string(state().live.dropped.load(std::memory_order_relaxed));
+    const std::string dropped_s = std::to_string(dropped_sites);
+    ::otrace::emit_instant_kvs("heap_report_stats","heap",
+                               "live_alloc_count", live_cnt.c_str(),
+                               "site_count",       sites_cnt.c_str(),
+                               "dropped_allocs",   dropped.c_str(),
+                               "dropped_sites",    dropped_s.c_str());
+    if (state().live.dropped.load(std::memory_order_relaxed))
+      ::otrace::emit_instant_kvs("heap_table_full","heap",
+                                 "dropped_allocs", dropped.c_str(),
+                                 "info", "figures undercount; raise OTRACE_HEAP_TABLE_BUCKETS");
+  }
+
+  // 5) Emit top leaks — with fallback text if we don't have a callsite entry
+  {
+    const int N = std::min<int>(10, leak_sizes.size());
+    if (N == 0 && unsampled_count == 0) {
+      ::otrace::emit_instant_kvs("heap_leaks","heap",
+                                 "info","no_live_allocations_detected");
+    } else {
+      for (int i = 0; i < N; ++i) {
+        const uint64_t hash = leak_sizes[i].hash;
+        const std::string totals = totals_text(leak_sizes[i].bytes, leak_sizes[i].count,
+                                               leak_sizes[i].scaled, by_site[hash].size());
+
+        const auto it = callsites.find(hash);
+        const bool have_cs = (it != callsites.end());
+        const std::string sample = have_cs ? stack_text(hash, it->second) : std::string();
+
+        std::string key   = "leak_" + std::to_string(i+1);
+        std::string value;
+        if (have_cs && !sample.empty()) {
+          value = sample + totals;
+        } else {
+          // fallback when callsite info is missing
+          char buf[32];
+          std::snprintf(buf, sizeof(buf), "hash=0x%016llx", (unsigned long long)hash);
+          value = buf + totals;
         }
-        
-        // Remove allocation
-        shard.allocations.erase(it);
+        ::otrace::emit_instant_sf(stack_sf(hash), "heap_leaks","heap", key.c_str(), value.c_str());
+      }
+    }
+    if (unsampled_count) {
+      // Raw, not added to the estimates above (which already stand for these)
+      const std::string value = std::to_string((unsigned long long)unsampled_bytes) + " bytes, " +
+                                std::to_string((unsigned long long)unsampled_count) + " allocations (raw)";
+      ::otrace::emit_instant_kvs("heap_leaks","heap", "unsampled", value.c_str());
+    }
+  }
+
+  // 6) Emit top allocation sites by estimated total bytes (or a fallback)
+  {
+    std::vector<std::pair<uint64_t, CallsiteStats>> sites(
+        callsites.begin(), callsites.end());
+    std::sort(sites.begin(), sites.end(),
+              [](const auto& a, const auto& b){
+                return a.second.est_bytes > b.second.est_bytes;
+              });
+
+    const int N = std::min<int>(10, sites.size());
+    if (N == 0) {
+      ::otrace::emit_instant_kvs("heap_sites","heap",
+                                 "info","no_callsite_info_available");
+    } else {
+      for (int i = 0; i < N; ++i) {
+        std::string key   = "site_" + std::to_string(i+1);
+        const CallsiteStats& cs = sites[i].second;
+        const bool scaled = std::fabs(cs.est_count - (double)cs.alloc_count) > 1e-6;
+        std::string value = stack_text(sites[i].first, cs) +
+                            totals_text(cs.est_bytes, cs.est_count, scaled, cs.alloc_count);
+        ::otrace::emit_instant_sf(stack_sf(sites[i].first), "heap_sites","heap", key.c_str(), value.c_str());
+      }
+    }
+
+    // 7) Lifetimes of freed samples, sites with the most short-lived churn first
+    std::stable_sort(sites.begin(), sites.end(),
+                     [](const auto& a, const auto& b){
+                       return a.second.freed_1ms > b.second.freed_1ms;
+                     });
+    auto life_pct = [](const uint64_t* h, uint64_t total, double q) -> std::string {
+      uint64_t seen = 0;
+      const uint64_t rank = (uint64_t)std::ceil(q * (double)total);
+      int b = 0;
+      for (; b < kLifeBuckets - 1; ++b) { seen += h[b]; if (seen >= rank) break; }
+      if (b == 0) return "<1us";
+      return (b == kLifeBuckets - 1 ? ">=" : "<") + std::to_string(1ull << (b == kLifeBuckets - 1 ? b - 1 : b)) + "us";
+    };
+    int emitted = 0;
+    for (const auto& site : sites) {
+      if (emitted == 10) break;
+      const CallsiteStats& cs = site.second;
+      uint64_t freed = 0;
+      for (int b = 0; b < kLifeBuckets; ++b) freed += cs.life[b];
+      if (freed == 0) continue;
+      char buf[192];
+      std::snprintf(buf, sizeof(buf),
+                    " (%llu freed samples; p50 %s, p90 %s, p99 %s; %.1f%% < 1us, %.1f%% < 1ms)",
+                    (unsigned long long)freed,
+                    life_pct(cs.life, freed, 0.50).c_str(),
+                    life_pct(cs.life, freed, 0.90).c_str(),
+                    life_pct(cs.life, freed, 0.99).c_str(),
+                    100.0 * (double)cs.life[0] / (double)freed,
+                    100.0 * (double)cs.freed_1ms / (double)freed);
+      const std::string key = "life_" + std::to_string(++emitted);
+      const std::string value = stack_text(site.first, cs) + buf;
+      ::otrace::emit_instant_sf(stack_sf(site.first), "heap_lifetimes","heap", key.c_str(), value.c_str());
+    }
+    if (emitted == 0) {
+      ::otrace::emit_instant_kvs("heap_lifetimes","heap",
+                                 "info","no_sampled_frees");
+    }
+  }
+
+#if OTRACE_HEAP_SCOPES
+  // 8) Allocations charged to trace scopes, merged by name over all threads
+  {
+    struct ScopeTotal { uint64_t calls = 0, count = 0, bytes = 0; };
+    std::map<std::pair<std::string, std::string>, ScopeTotal> by_scope;
+    for (ScopeAllocTable* t = state().scope_tables.load(std::memory_order_acquire); t; t = t->next) {
+      for (const ScopeAllocSlot& slot : t->slots) {
+        const char* nm = slot.name.load(std::memory_order_acquire);
+        if (!nm) continue;
+        const uint64_t calls = slot.calls.load(std::memory_order_relaxed);
+        if (!calls) continue;
+        ScopeTotal& st = by_scope[{nm, slot.cat ? slot.cat : ""}];
+        st.calls += calls;
+        st.count += slot.count.load(std::memory_order_relaxed);
+        st.bytes += slot.bytes.load(std::memory_order_relaxed);
+      }
+    }
+    std::vector<std::pair<std::pair<std::string, std::string>, ScopeTotal>> scopes(
+        by_scope.begin(), by_scope.end());
+    std::stable_sort(scopes.begin(), scopes.end(),
+                     [](const auto& a, const auto& b){ return a.second.bytes > b.second.bytes; });
+    const int N = std::min<int>(10, scopes.size());
+    if (N == 0) {
+      ::otrace::emit_instant_kvs("heap_scopes","heap",
+                                 "info","no_scope_allocations");
+    }
+    for (int i = 0; i < N; ++i) {
+      const auto& sc = scopes[i];
+      char buf[160];
+      std::snprintf(buf, sizeof(buf), " (%llu bytes, %llu allocations in %llu calls)",
+                    (unsigned long long)sc.second.bytes,
+                    (unsigned long long)sc.second.count,
+                    (unsigned long long)sc.second.calls);
+      const std::string key = "scope_" + std::to_string(i + 1);
+      const std::string value = sc.first.first +
+                                (sc.first.second.empty() ? "" : " [" + sc.first.second + "]") + buf;
+      ::otrace::emit_instant_kvs("heap_scopes","heap", key.c_str(), value.c_str());
+    }
+  }
+#endif
+
+  // 9) Size-class table over all allocations, then the live size mix of the
+  //    biggest live groups
+  {
+    SizeClassTotals tot;
+    merge_size_classes(tot);
+    for (int c = 0; c < kSizeClasses; ++c) {
+      if (!tot.allocs[c]) continue;
+      char label[16];
+      size_class_label(c, label, sizeof(label));
+      ::otrace::emit_instant_kvs("heap_size_classes","heap",
+                                 "class",       label,
+                                 "allocs",      (double)tot.allocs[c],
+                                 "alloc_bytes", (double)tot.alloc_bytes[c],
+                                 "live_bytes",  (double)tot.live_bytes[c]);
+    }
+    const int N = std::min<int>(3, leak_sizes.size());
+    for (int i = 0; i < N; ++i) {
+      const uint64_t hash = leak_sizes[i].hash;
+      uint64_t cnt[kSizeClasses] = {}, bytes[kSizeClasses] = {};
+      for (const auto& alloc : by_site[hash]) {
+        const int c = size_class(alloc.second.size);
+        cnt[c] += 1;
+        bytes[c] += alloc.second.size;
+      }
+      const auto it = callsites.find(hash);
+      std::string value = it != callsites.end() ? stack_text(hash, it->second) : std::string("(unsampled)");
+      value += ":";
+      for (int c = 0; c < kSizeClasses; ++c) {
+        if (!cnt[c]) continue;
+        char label[16], part[80];
+        size_class_label(c, label, sizeof(label));
+        std::snprintf(part, sizeof(part), " %s x %llu (%llu bytes)", label,
+                      (unsigned long long)cnt[c], (unsigned long long)bytes[c]);
+        value += part;
+      }
+      const std::string key = "leak_" + std::to_string(i + 1);
+      ::otrace::emit_instant_sf(stack_sf(hash), "heap_site_sizes","heap", key.c_str(), value.c_str());
+    }
+  }
+
+  // 10) Live allocations by age, then the sites that are both old and still
+  //     growing across the stored snapshots: long-lived state that has stopped
+  //     growing (caches filled at startup) is left out
+  {
+    double limits[kAgeThresholds];
+    const int nlim = std::min(kAgeThresholds, state().age_threshold_count.load(std::memory_order_relaxed));
+    for (int i = 0; i < nlim; ++i) limits[i] = state().age_thresholds[i].load(std::memory_order_relaxed);
+    auto age_bucket = [&](double age_s) { int b = 0; while (b < nlim && age_s >= limits[b]) ++b; return b; };
+    auto secs_text = [](double s) { char b[24]; std::snprintf(b, sizeof(b), "%gs", s); return std::string(b); };
+
+    const uint64_t now = ::otrace::now_us();
+    double age_count[kAgeThresholds + 1] = {}, age_bytes[kAgeThresholds + 1] = {};
+    struct OldSite { uint64_t hash; double bytes; double count; };
+    std::vector<OldSite> old_sites;
+    for (const auto& kv : by_site) {
+      OldSite o{kv.first, 0.0, 0.0};
+      for (const auto& alloc : kv.second) {
+        const AllocEntry& e = alloc.second;
+        const int b = age_bucket(now > e.timestamp ? (double)(now - e.timestamp) / 1e6 : 0.0);
+        // Every live allocation is in the table, so the buckets count raw;
+        // a site only holds its samples, so its old total is weighted
+        age_count[b] += 1.0;
+        age_bytes[b] += (double)e.size;
+        if (b == nlim && nlim > 0) { o.count += e.weight; o.bytes += (double)e.weight * (double)e.size; }
+      }
+      if (kv.first != 0 && o.count > 0.0) old_sites.push_back(o);
+    }
+    for (int b = 0; b <= nlim; ++b) {
+      if (age_count[b] <= 0.0) continue;
+      const std::string label = nlim == 0 ? std::string("all")
+                              : b == 0    ? "<" + secs_text(limits[0])
+                              : b == nlim ? ">=" + secs_text(limits[nlim - 1])
+                              : secs_text(limits[b - 1]) + "-" + secs_text(limits[b]);
+      ::otrace::emit_instant_kvs("heap_ages","heap",
+                                 "age",    label.c_str(),
+                                 "allocs", age_count[b],
+                                 "bytes",  age_bytes[b]);
+    }
+
+    // Growing: live count never dropped from one snapshot to the next (or to
+    // now) and rose overall
+    std::vector<Snapshot> snaps;
+    {
+      std::lock_guard<std::mutex> lk(state().snapshot_mu);
+      snaps = state().snapshots;
+    }
+    struct Suspect { OldSite site; double first; double last; };
+    std::vector<Suspect> suspects;
+    for (const OldSite& o : old_sites) {
+      const auto cs = callsites.find(o.hash);
+      if (cs == callsites.end() || snaps.empty()) continue;
+      double prev = -1.0, first = -1.0;
+      bool growing = true;
+      for (const Snapshot& sn : snaps) {
+        const auto it = sn.sites.find(o.hash);
+        const double c = it != sn.sites.end() ? it->second.count : 0.0;
+        if (first < 0.0) first = c;
+        if (prev >= 0.0 && c + 0.5 < prev) { growing = false; break; }
+        prev = c;
+      }
+      const double last = cs->second.est_live_count;
+      if (growing && last + 0.5 >= prev && last >= first + 1.0) suspects.push_back({o, first, last});
+    }
+    std::sort(suspects.begin(), suspects.end(),
+              [](const Suspect& a, const Suspect& b){ return a.site.bytes > b.site.bytes; });
+
+    const int N = std::min<int>(10, suspects.size());
+    if (N == 0) {
+      ::otrace::emit_instant_kvs("heap_suspects","heap",
+                                 "info", snaps.empty() ? "no_snapshots" : "no_old_growing_sites");
+    }
+    for (int i = 0; i < N; ++i) {
+      const Suspect& sp = suspects[i];
+      char buf[160];
+      std::snprintf(buf, sizeof(buf), " (%lld bytes in %lld allocations older than %s; live count %lld -> %lld over %zu snapshots)",
+                    (long long)std::llround(sp.site.bytes), (long long)std::llround(sp.site.count),
+                    nlim ? secs_text(limits[nlim - 1]).c_str() : "0s",
+                    (long long)std::llround(sp.first), (long long)std::llround(sp.last), snaps.size());
+      const std::string key = "suspect_" + std::to_string(i + 1);
+      const std::string value = stack_text(sp.site.hash, callsites.at(sp.site.hash)) + buf;
+      ::otrace::emit_instant_sf(stack_sf(sp.site.hash), "heap_suspects","heap", key.c_str(), value.c_str());
     }
+  }
+
+  // 11) Named heaps (sites from them appear above, tagged [name])
+  {
+    const uint32_t n = state().named_count.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < n; ++i) {
+      const NamedHeap& nh = state().named[i];
+      const uint64_t allocs = nh.allocs.load(std::memory_order_relaxed);
+      const uint64_t bytes  = nh.alloc_bytes.load(std::memory_order_relaxed);
+      char name[64];
+      std::snprintf(name, sizeof(name), "%s (%llu allocations, %llu bytes total)", nh.name,
+                    (unsigned long long)allocs, (unsigned long long)bytes);
+      ::otrace::emit_instant_kvs("heap_named","heap",
+                                 "heap",        name,
+                                 "live_bytes",  (double)nh.live_bytes.load(std::memory_order_relaxed),
+                                 "live_allocs", (double)nh.live_count.load(std::memory_order_relaxed),
+                                 "peak_bytes",  (double)nh.peak_bytes.load(std::memory_order_relaxed));
+    }
+  }
+
+  // 12) The high-water mark and what was live when it was last snapshotted
+  {
+    Snapshot peak;
+    {
+      std::lock_guard<std::mutex> lk(state().snapshot_mu);
+      peak = state().peak_snapshot;
+    }
+    const uint64_t now = ::otrace::now_us();
+    const uint64_t peak_ts = state().peak_ts.load(std::memory_order_relaxed);
+    ::otrace::emit_instant_kvs("heap_peak_stats","heap",
+                               "peak_bytes",     (double)state().peak_bytes.load(std::memory_order_relaxed),
+                               "peak_age_s",     peak_ts && now > peak_ts ? (double)(now - peak_ts) / 1e6 : 0.0,
+                               "snapshot_bytes", (double)state().peak_snapshot_bytes.load(std::memory_order_relaxed),
+                               "live_bytes",     (double)state().live_bytes.load(std::memory_order_relaxed));
+    std::vector<std::pair<uint64_t, SnapshotSite>> at_peak(peak.sites.begin(), peak.sites.end());
+    std::sort(at_peak.begin(), at_peak.end(),
+              [](const auto& a, const auto& b){ return a.second.bytes > b.second.bytes; });
+    const int N = std::min<int>(10, at_peak.size());
+    if (N == 0) {
+      ::otrace::emit_instant_kvs("heap_peak","heap",
+                                 "info","no_peak_snapshot");
+    }
+    for (int i = 0; i < N; ++i) {
+      const uint64_t hash = at_peak[i].first;
+      const auto it = callsites.find(hash);
+      std::string value = it != callsites.end() ? stack_text(hash, it->second) : std::string();
+      if (value.empty()) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "hash=0x%016llx", (unsigned long long)hash);
+        value = buf;
+      }
+      char buf[128];
+      std::snprintf(buf, sizeof(buf), " (%lld bytes, %lld allocations at peak; %lld bytes now)",
+                    (long long)std::llround(at_peak[i].second.bytes),
+                    (long long)std::llround(at_peak[i].second.count),
+                    it != callsites.end() ? (long long)std::llround(std::max(0.0, it->second.est_live_bytes)) : 0ll);
+      const std::string key = "peak_" + std::to_string(i + 1);
+      value += buf;
+      ::otrace::emit_instant_sf(stack_sf(hash), "heap_peak","heap", key.c_str(), value.c_str());
+    }
+  }
+
+  ::otrace::emit_instant_kvs("heap_report_done", "heap", "status", "end");
 }
 
-// Generate heap report
-inline void generate_report() {
+// Record a named snapshot and mark it on the timeline. Costs one pass over
+// the site tables; the live allocation table is not touched.
+inline void snapshot(const char* name) {
   if (!state().enabled.load(std::memory_order_relaxed)) return;
+  otrace::TracerGuard _tg;
+  async_drain();
+  const std::unordered_map<uint64_t, CallsiteStats> callsites = merge_sites();
+  take_peak_snapshot(&callsites);
+  Snapshot snap = take_snapshot(name, callsites);
+  double bytes = 0.0;
+  for (const auto& kv : snap.sites) bytes += kv.second.bytes;
+  ::otrace::emit_instant_kvs("heap_snapshot", "heap",
+                             "name",       snap.name.c_str(),
+                             "sites",      (double)snap.sites.size(),
+                             "live_bytes", bytes);
+  std::lock_guard<std::mutex> lk(state().snapshot_mu);
+  auto& all = state().snapshots;
+  if (all.size() >= (size_t)OTRACE_HEAP_MAX_SNAPSHOTS) all.erase(all.begin());
+  all.push_back(std::move(snap));
+}
 
-  ::otrace::emit_instant_kvs("heap_report_started", "heap", "status", "begin");
+// Emit the sites whose estimated live bytes grew most between snapshot
+// `from` and snapshot `to` (the latest of each name), or the current state
+// when `to` is null.
+inline void diff_snapshots(const char* from, const char* to) {
+  if (!state().enabled.load(std::memory_order_relaxed)) return;
+  otrace::TracerGuard _tg;
+  async_drain();
+  const std::unordered_map<uint64_t, CallsiteStats> callsites = merge_sites();
 
-  // 1) Snapshot live allocations
-  std::vector<std::pair<void*, AllocEntry>> all_allocs;
-  all_allocs.reserve(1024);
-  for (int i = 0; i < OTRACE_HEAP_SHARDS; ++i) {
-    std::lock_guard<std::mutex> lk(state().shards[i].mutex);
-    all_allocs.insert(all_allocs.end(),
-                      state().shards[i].allocations.begin(),
-                      state().shards[i].allocations.end());
+  Snapshot a, b;
+  bool have_a = false, have_b = false;
+  {
+    std::lock_guard<std::mutex> lk(state().snapshot_mu);
+    for (const Snapshot& sn : state().snapshots) {
+      if (from && sn.name == from) { a = sn; have_a = true; }
+      if (to && sn.name == to)     { b = sn; have_b = true; }
+    }
   }
-
-  // 2) Group by callsite hash
-  std::unordered_map<uint64_t, std::vector<std::pair<void*, AllocEntry>>> by_site;
-  for (const auto& p : all_allocs) {
-    by_site[p.second.stack_hash].push_back(p);
+  if (!to) { b = take_snapshot("now", callsites); have_b = true; }
+  if (!have_a || !have_b) {
+    ::otrace::emit_instant_kvs("heap_growth", "heap",
+                               "info", "snapshot_not_found",
+                               "missing", !have_a ? (from ? from : "") : to);
+    return;
   }
 
-  // 3) Sort sites by total bytes
-  std::vector<std::pair<uint64_t, uint64_t>> leak_sizes;
-  leak_sizes.reserve(by_site.size());
-  for (const auto& kv : by_site) {
-    uint64_t total = 0;
-    for (const auto& alloc : kv.second) total += alloc.second.size;
-    leak_sizes.emplace_back(kv.first, total);
+  struct Growth { uint64_t hash; double bytes; double count; double now_bytes; };
+  std::vector<Growth> grown;
+  double total = 0.0;
+  for (const auto& kv : b.sites) {
+    const auto old = a.sites.find(kv.first);
+    const double db = kv.second.bytes - (old != a.sites.end() ? old->second.bytes : 0.0);
+    const double dc = kv.second.count - (old != a.sites.end() ? old->second.count : 0.0);
+    total += db;
+    if (db >= 1.0) grown.push_back({kv.first, db, dc, kv.second.bytes});   // ignore float drift
   }
-  std::sort(leak_sizes.begin(), leak_sizes.end(),
-            [](const auto& a, const auto& b){ return a.second > b.second; });
-
-  // 4) Emit summary stats (always)
-  {
-    const std::string live_cnt = std::to_string(all_allocs.size());
-    const std::string sites_cnt = std::to_string(by_site.size());
-    ::otrace::emit_instant_kvs("heap_report_stats","heap",
-                               "live_alloc_count", live_cnt.c_str(),
-                               "site_count",       sites_cnt.c_str());
+  for (const auto& kv : a.sites)   // sites that were freed entirely
+    if (!b.sites.count(kv.first)) total -= kv.second.bytes;
+  std::sort(grown.begin(), grown.end(),
+            [](const Growth& x, const Growth& y){ return x.bytes > y.bytes; });
+
+  const double secs = b.ts > a.ts ? (double)(b.ts - a.ts) / 1e6 : 0.0;
+  ::otrace::emit_instant_kvs("heap_growth", "heap",
+                             "from",        a.name.c_str(),
+                             "to",          b.name.c_str(),
+                             "interval_s",  secs,
+                             "delta_bytes", total);
+  const int N = std::min<int>(10, grown.size());
+  for (int i = 0; i < N; ++i) {
+    const Growth& g = grown[i];
+    const auto it = callsites.find(g.hash);
+    const SiteLabel label = it != callsites.end() ? site_label(it->second) : SiteLabel{std::string(), 0};
+    std::string value = label.text;
+    if (value.empty()) {
+      char buf[32];
+      std::snprintf(buf, sizeof(buf), "hash=0x%016llx", (unsigned long long)g.hash);
+      value = buf;
+    }
+    char buf[160];
+    std::snprintf(buf, sizeof(buf), " (+%lld bytes, %+lld allocations; %lld bytes live)",
+                  (long long)std::llround(g.bytes), (long long)std::llround(g.count),
+                  (long long)std::llround(g.now_bytes));
+    value += buf;
+    const std::string key = "grow_" + std::to_string(i + 1);
+    ::otrace::emit_instant_sf(label.sf, "heap_growth", "heap", key.c_str(), value.c_str());
   }
+  if (N == 0) ::otrace::emit_instant_kvs("heap_growth", "heap", "info", "no_growth");
+}
 
-  // 5) Emit top leaks — with fallback text if we don't have a callsite entry
-  {
-    std::lock_guard<std::mutex> lk(state().callsites_mutex);
-    const int N = std::min<int>(10, leak_sizes.size());
-    if (N == 0) {
-      ::otrace::emit_instant_kvs("heap_leaks","heap",
-                                 "info","no_live_allocations_detected");
-    } else {
-      for (int i = 0; i < N; ++i) {
-        const uint64_t hash = leak_sizes[i].first;
-        const uint64_t size = leak_sizes[i].second;
-
-        const auto it = state().callsites.find(hash);
-        const bool have_cs = (it != state().callsites.end());
-        const std::string& sample = have_cs ? it->second.sample_stack : std::string();
+// ---- Timeline sampler -------------------------------------------------------
+// Background thread that emits, every timeline_ms: heap_live_bytes, the
+// size-class tracks, one "heap_site <frame> #<hash>" track per top-K site by
+// estimated live bytes, and one "heap_thread <tid>" allocation-rate track per
+// thread. Nothing is emitted from the allocation hook while it runs.
+inline void timeline_loop() {
+  otrace::tls_in_tracer = true;   // nothing this thread allocates is heap-traced
+  State& S = state();
+  std::unordered_map<uint64_t, std::string> names;         // site hash -> track name
+  std::vector<uint64_t> shown;                             // sites emitted last tick
+  struct ThreadPrev { uint32_t tid; uint64_t allocs, bytes; };
+  std::unordered_map<const SiteTable*, ThreadPrev> prev;
+  uint64_t last = 0;
+
+  auto site_name = [&](uint64_t hash, const CallsiteStats& cs) -> const std::string& {
+    auto it = names.find(hash);
+    if (it != names.end()) return it->second;
+    std::string frame = format_stack(cs.frames, cs.depth > 0 ? 1 : 0);
+    if (frame.empty()) frame = "?";   // no frames captured
+    char tail[24];
+    std::snprintf(tail, sizeof(tail), " #%04llx", (unsigned long long)(hash & 0xffff));
+    if (frame.size() > 32) frame.resize(32);   // keeps the hash suffix within the event name
+    return names.emplace(hash, "heap_site " + frame + tail).first->second;
+  };
 
-        std::string key   = "leak_" + std::to_string(i+1);
-        std::string value;
-        if (have_cs && !sample.empty()) {
-          value = sample + " (" +
-                  std::to_string(size) + " bytes, " +
-                  std::to_string(by_site[hash].size()) + " allocations)";
-        } else {
-          // fallback when callsite info is missing
-          char buf[128];
-          std::snprintf(buf, sizeof(buf),
-                        "hash=0x%016llx (%llu bytes, %zu allocations)",
-                        (unsigned long long)hash,
-                        (unsigned long long)size,
-                        by_site[hash].size());
-          value = buf;
+  while (!S.timeline_stop.load(std::memory_order_acquire)) {
+    const uint64_t now = ::otrace::now_us();
+    if (S.enabled.load(std::memory_order_relaxed)) {
+      {
+        const char* k[] = { "heap_live_bytes" };
+        double v[] = { (double)S.live_bytes.load(std::memory_order_relaxed) };
+        ::otrace::emit_counter_n("heap_live_bytes", nullptr, 1, k, v);
+      }
+      emit_size_class_counters(now, last);
+      emit_named_heap_counters();
+
+      // Top-K sites; sites that drop out get one final point so their
+      // track does not freeze at a stale value
+      const std::unordered_map<uint64_t, CallsiteStats> callsites = merge_sites();
+      take_peak_snapshot(&callsites);
+      std::vector<std::pair<double, uint64_t>> ranked;
+      ranked.reserve(callsites.size());
+      for (const auto& kv : callsites)
+        if (kv.second.est_live_bytes >= 1.0) ranked.emplace_back(kv.second.est_live_bytes, kv.first);
+      const size_t K = std::min<size_t>(S.timeline_top, ranked.size());
+      std::partial_sort(ranked.begin(), ranked.begin() + K, ranked.end(),
+                        [](const auto& a, const auto& b){ return a.first > b.first; });
+      std::vector<uint64_t> top;
+      for (size_t i = 0; i < K; ++i) top.push_back(ranked[i].second);
+      for (uint64_t h : shown)
+        if (std::find(top.begin(), top.end(), h) == top.end()) top.push_back(h);
+      for (uint64_t h : top) {
+        const auto it = callsites.find(h);
+        const char* k[] = { "live_bytes", "live_allocs" };
+        const double v[] = { it != callsites.end() ? std::max(0.0, it->second.est_live_bytes) : 0.0,
+                             it != callsites.end() ? std::max(0.0, it->second.est_live_count) : 0.0 };
+        const std::string& name = it != callsites.end() ? site_name(h, it->second) : names[h];
+        if (!name.empty()) ::otrace::emit_counter_n(name.c_str(), "heap", 2, k, v);
+      }
+      top.resize(K);
+      shown.swap(top);
+
+      // Allocation rate per thread (every allocation, not just samples)
+      const double secs = last && now > last ? (double)(now - last) / 1e6 : 0.0;
+      for (SiteTable* t = S.site_tables.load(std::memory_order_acquire); t; t = t->next) {
+        uint64_t allocs = 0, bytes = 0;
+        for (int c = 0; c < kSizeClasses; ++c) {
+          allocs += t->class_allocs[c].load(std::memory_order_relaxed);
+          bytes  += t->class_alloc_bytes[c].load(std::memory_order_relaxed);
         }
-        ::otrace::emit_instant_kvs("heap_leaks","heap", key.c_str(), value.c_str());
+        const uint32_t tid = t->tid.load(std::memory_order_relaxed);
+        auto p = prev.find(t);
+        const bool fresh = p == prev.end() || p->second.tid != tid ||
+                           allocs < p->second.allocs;   // adopted or reset since last tick
+        if (!fresh && secs > 0.0 && t->in_use.load(std::memory_order_relaxed)) {
+          char name[32];
+          std::snprintf(name, sizeof(name), "heap_thread %u", tid);
+          const char* k[] = { "allocs_per_s", "bytes_per_s" };
+          const double v[] = { (double)(allocs - p->second.allocs) / secs,
+                               (double)(bytes - p->second.bytes) / secs };
+          ::otrace::emit_counter_n(name, "heap", 2, k, v);
+        }
+        prev[t] = ThreadPrev{tid, allocs, bytes};
       }
+      last = now;
     }
-  }
 
-  // 6) Emit top allocation sites by total bytes (or a fallback)
-  {
-    std::vector<std::pair<uint64_t, CallsiteStats>> sites(
-        state().callsites.begin(), state().callsites.end());
-    std::sort(sites.begin(), sites.end(),
-              [](const auto& a, const auto& b){
-                return a.second.total_bytes > b.second.total_bytes;
-              });
-
-    const int N = std::min<int>(10, sites.size());
-    if (N == 0) {
-      ::otrace::emit_instant_kvs("heap_sites","heap",
-                                 "info","no_callsite_info_available");
-    } else {
-      for (int i = 0; i < N; ++i) {
-        std::string key   = "site_" + std::to_string(i+1);
-        std::string value = sites[i].second.sample_stack + " (" +
-                            std::to_string(sites[i].second.total_bytes) + " bytes, " +
-                            std::to_string(sites[i].second.alloc_count) + " allocations)";
-        ::otrace::emit_instant_kvs("heap_sites","heap", key.c_str(), value.c_str());
-      }
+    const uint64_t until = now + (uint64_t)S.timeline_ms * 1000u;
+    while (!S.timeline_stop.load(std::memory_order_acquire)) {
+      const uint64_t t = ::otrace::now_us();
+      if (t >= until) break;
+      take_peak_snapshot();   // a peak flagged mid-interval is not left waiting for the tick
+      std::this_thread::sleep_for(std::chrono::milliseconds(std::min<uint64_t>((until - t) / 1000u + 1, 100)));
     }
   }
+}
 
-  ::otrace::emit_instant_kvs("heap_report_done", "heap", "status", "end");
+inline void timeline_stop() {
+  State& S = state();
+  S.timeline_stop.store(true, std::memory_order_release);
+  if (S.timeline_thr.joinable()) S.timeline_thr.join();
+  S.timeline_on.store(false, std::memory_order_release);
 }
 
+// Start (or restart) the timeline sampler with `top_k` site tracks
+inline void timeline_start(uint32_t interval_ms, uint32_t top_k) {
+  timeline_stop();
+  State& S = state();
+  S.timeline_ms = interval_ms ? interval_ms : 1000;
+  S.timeline_top = top_k;
+  S.timeline_stop.store(false, std::memory_order_release);
+  static bool at_exit = (std::atexit(timeline_stop), true);   // join before statics go away
+  (void)at_exit;
+  otrace::TracerGuard _tg;
+  S.timeline_on.store(true, std::memory_order_release);
+  S.timeline_thr = std::thread(timeline_loop);
+}
 
 // Public API
 inline void enable(bool on) {
     state().enabled.store(on, std::memory_order_release);
     if (on) {
+        async_drain();   // records from before the reset must not land after it
         state().live_bytes = 0;
         state().total_allocations = 0;
         state().total_frees = 0;
-        for (int i = 0; i < OTRACE_HEAP_SHARDS; ++i) {
-            std::lock_guard<std::mutex> lock(state().shards[i].mutex);
-            state().shards[i].allocations.clear();
+        state().live.clear();
+        reset_sites();
+        otrace::TracerGuard _tg;
+        std::lock_guard<std::mutex> lk(state().snapshot_mu);
+        state().snapshots.clear();   // counters restart from zero; old snapshots no longer compare
+        state().peak_snapshot = Snapshot{};
+        state().peak_bytes = 0;
+        state().peak_ts = 0;
+        state().peak_snapshot_bytes = 0;
+        state().peak_snapshot_due = false;
+        for (NamedHeap& nh : state().named) {   // registrations survive
+            nh.live_bytes = 0;
+            nh.live_count = 0;
+            nh.allocs = 0;
+            nh.alloc_bytes = 0;
+            nh.peak_bytes = 0;
         }
-        std::lock_guard<std::mutex> lock(state().callsites_mutex);
-        state().callsites.clear();
+#if OTRACE_HEAP_ASYNC
+        async_start();
+#endif
     }
 }
 
@@ -821,6 +3113,54 @@ inline void set_sampling(double rate) {
     state().sample_rate.store(rate, std::memory_order_release);
 }
 
+// Mean bytes between samples; nonzero takes precedence over set_sampling
+inline void set_sample_bytes(uint64_t mean) {
+    state().sample_bytes.store(mean, std::memory_order_release);
+}
+
+// Id for a named heap, registering it on first use (same name, same id).
+// Returns 0 once OTRACE_HEAP_MAX_NAMED heaps exist; calls with id 0 are ignored.
+inline uint32_t register_heap(const char* name) {
+    if (!name) name = "";
+    State& S = state();
+    std::lock_guard<std::mutex> lk(S.named_mu);
+    const uint32_t n = S.named_count.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < n; ++i)
+        if (std::strncmp(S.named[i].name, name, sizeof(S.named[i].name) - 1) == 0) return i + 1;
+    if (n >= (uint32_t)OTRACE_HEAP_MAX_NAMED) return 0;
+    std::snprintf(S.named[n].name, sizeof(S.named[n].name), "%s", name);
+    S.named_count.store(n + 1, std::memory_order_release);
+    return n + 1;
+}
+
+// Inlined so the stack record_alloc captures starts at the allocator's frame
+OTRACE_FORCE_INLINE void heap_alloc(uint32_t id, void* ptr, size_t size) {
+    if (id == 0 || id > state().named_count.load(std::memory_order_acquire)) return;
+    record_alloc(ptr, size, id, 1);
+}
+
+inline void heap_free(uint32_t id, void* ptr) {
+    if (id == 0 || id > state().named_count.load(std::memory_order_acquire)) return;
+    record_free(ptr, id);
+}
+
+// Re-snapshot the site breakdown whenever live bytes exceed the last peak
+// snapshot by this fraction (0.10 = 10%)
+inline void set_peak_margin(double fraction) {
+    state().peak_margin.store(fraction > 0.0 ? fraction : 0.0, std::memory_order_release);
+}
+
+// Age bucket boundaries in seconds (ascending, at most kAgeThresholds; extra
+// ones are ignored). Allocations past the last boundary count as old.
+inline void set_age_thresholds(const double* secs, int n) {
+    n = std::max(0, std::min(n, kAgeThresholds));
+    double sorted[kAgeThresholds];
+    for (int i = 0; i < n; ++i) sorted[i] = secs[i] > 0.0 ? secs[i] : 0.0;
+    std::sort(sorted, sorted + n);
+    for (int i = 0; i < n; ++i) state().age_thresholds[i].store(sorted[i], std::memory_order_relaxed);
+    state().age_threshold_count.store(n, std::memory_order_release);
+}
+
 } // namespace heap
 
 #endif // OTRACE_HEAP
@@ -876,14 +3216,90 @@ struct Event {
   char     cname[OTRACE_MAX_CNAME]; // optional color name
   uint8_t  argc;              // number of args used
   Arg      args[OTRACE_MAX_ARGS];
+  uint32_t sf;                // stackFrames id (0 = none)
   std::atomic<uint8_t> committed;   // 0 while being written, 1 when complete
 
-  Event() : ts_us(0), dur_us(0), flow_id(0), pid(0), tid(0), ph(Phase::I), argc(0), committed{0} {
+  Event() : ts_us(0), dur_us(0), flow_id(0), pid(0), tid(0), ph(Phase::I), argc(0), sf(0), committed{0} {
     name[0]=cat[0]=cname[0]='\0';
     for (int i=0;i<OTRACE_MAX_ARGS;i++){ args[i].key[0]='\0'; args[i].kind=ArgKind::None; args[i].num=0; args[i].str[0]='\0'; }
   }
 };
 
+#if OTRACE_SCOPE_STATS
+// ---- Live scope statistics (per-thread, optional) -------------------------
+// Each thread owns a fixed open-addressed table keyed by the scope's name/cat
+// pointers (one slot per callsite literal). Only the owner writes; readers merge
+// all tables under a per-table seqlock so count/total/histogram stay coherent.
+static_assert((OTRACE_SCOPE_STATS_SLOTS & (OTRACE_SCOPE_STATS_SLOTS - 1)) == 0,
+              "OTRACE_SCOPE_STATS_SLOTS must be a power of two");
+
+struct ScopeSlot {
+  std::atomic<const char*> key { nullptr };   // name pointer; published last
+  const char* cat_key = nullptr;
+  char name[OTRACE_MAX_NAME];
+  char cat[OTRACE_MAX_CAT];
+  std::atomic<uint64_t> count { 0 };
+  std::atomic<uint64_t> total_us { 0 };
+  std::atomic<uint64_t> min_us { 0 };
+  std::atomic<uint64_t> max_us { 0 };
+  std::atomic<uint64_t> hist[OTRACE_STATS_BUCKETS] = {};
+};
+
+struct CounterSlot {
+  std::atomic<const char*> key { nullptr };   // name pointer; published last
+  const char* cat_key = nullptr;
+  char name[OTRACE_MAX_NAME];
+  char cat[OTRACE_MAX_CAT];
+  uint8_t nseries = 0;
+  char series[OTRACE_MAX_ARGS][OTRACE_MAX_ARGK];
+  std::atomic<double> vals[OTRACE_MAX_ARGS] = {};
+  std::atomic<uint64_t> ts_us { 0 };
+  std::atomic<uint64_t> updates { 0 };
+};
+
+struct StatsTable {
+  std::atomic<uint32_t> seq { 0 };            // odd while the owner is updating
+  std::atomic<uint64_t> dropped { 0 };        // updates lost because the table was full
+  ScopeSlot scopes[OTRACE_SCOPE_STATS_SLOTS];
+  CounterSlot counters[OTRACE_SCOPE_STATS_SLOTS];
+
+  void begin_write() {
+    seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  void end_write() { seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+};
+
+inline int stats_bucket(uint64_t us) {
+  int b = 0;
+  while (us && b < OTRACE_STATS_BUCKETS - 1) { us >>= 1; ++b; }
+  return b;
+}
+
+// Find (or claim) the slot for a name/cat pointer pair. Owner thread only.
+// Returns nullptr when the table is full; *fresh is set for a newly claimed slot,
+// whose key the caller publishes after filling in the rest.
+template <class Slot>
+inline Slot* stats_find(Slot* slots, const char* name, const char* cat, bool* fresh) {
+  const uint32_t mask = OTRACE_SCOPE_STATS_SLOTS - 1;
+  uint32_t h = (uint32_t)(((uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull) >> 32);
+  *fresh = false;
+  for (uint32_t i = 0; i <= mask; ++i) {
+    Slot& sl = slots[(h + i) & mask];
+    const char* k = sl.key.load(std::memory_order_relaxed);
+    if (!k) {
+      std::snprintf(sl.name, sizeof(sl.name), "%s", name);
+      std::snprintf(sl.cat,  sizeof(sl.cat),  "%s", cat ? cat : "");
+      sl.cat_key = cat;
+      *fresh = true;
+      return &sl;
+    }
+    if (k == name && sl.cat_key == cat) return &sl;
+  }
+  return nullptr;
+}
+#endif // OTRACE_SCOPE_STATS
+
 // Per‑thread ring buffer, lock‑free for the owning thread.
 struct ThreadBuffer {
   ThreadBuffer* next;
@@ -897,6 +3313,9 @@ struct ThreadBuffer {
   uint32_t      head;
   bool          wrapped;
   char          pending_cname[OTRACE_MAX_CNAME]; // color hint for next event only
+#if OTRACE_SCOPE_STATS
+  std::atomic<StatsTable*> stats { nullptr };     // lazily allocated on first scope
+#endif
 
   ThreadBuffer(uint32_t capacity)
   : next(nullptr), tid_v(otrace::tid()), thread_sort_index(0), buf(nullptr),
@@ -906,7 +3325,12 @@ struct ThreadBuffer {
     buf = new Event[cap];
   }
 
-  ~ThreadBuffer() { delete[] buf; }
+  ~ThreadBuffer() {
+    delete[] buf;
+#if OTRACE_SCOPE_STATS
+    delete stats.load(std::memory_order_relaxed);
+#endif
+  }
 
 Event* append() {
     otrace::TracerGuard _tg;  
@@ -939,6 +3363,9 @@ struct Registry {
   double sample_keep = 1.0;               // 0..1
   char allow_cats[256];                   // CSV allowlist
   char deny_cats[256];                    // CSV denylist
+  char downsample[256];                   // counter budgets: "name_or_cat=points,..."
+  uint64_t coalesce_gap_us = OTRACE_COALESCE_GAP_US;   // 0 = off
+  uint64_t coalesce_max_us = OTRACE_COALESCE_MAX_US;   // 0 = any duration
 
   enum class FlushMode { PauseAppenders, Quiescent };
   std::atomic<FlushMode> flush_mode { FlushMode::PauseAppenders };
@@ -957,6 +3384,25 @@ struct Registry {
   bool     pattern_has_index = false; // true if pattern contains a %d
   bool     pattern_use_gzip  = false; // true if pattern ends with .gz and gzip is available
 
+#if OTRACE_SCOPE_STATS
+  // metrics exporter (background thread; file or unix socket)
+  std::atomic<bool> metrics_stop { false };
+  std::thread       metrics_thr;
+  uint32_t          metrics_ms = 1000;
+  char              metrics_target[256] = {};
+#endif
+
+  // process memory sampler (background thread; /proc, getrusage, mallinfo2)
+  std::atomic<bool> mem_stop { false };
+  std::thread       mem_thr;
+  uint32_t          mem_ms = 100;
+
+  // stackFrames dictionary: interned (parent, name) frames, id = index + 1
+  struct StackFrame { std::string name, cat; uint32_t parent; };
+  std::mutex sf_mu;
+  std::vector<StackFrame> stack_frames;
+  std::map<std::pair<uint32_t, std::string>, uint32_t> stack_frame_ids;
+
   // synthesis (post-process at flush)
   std::atomic<bool> synth_enabled { OTRACE_SYNTHESIZE_TRACKS != 0 };
 
@@ -965,6 +3411,8 @@ struct Registry {
     uint32_t pct_count;
     double   pct_vals[8];          // 0..1 (e.g. 0.50, 0.95, 0.99)
     char     pct_names[8][8];      // labels (e.g. "p50")
+    uint64_t stall_us;             // min gap between top-level slices (0 = off)
+    char     idle_threads[256];    // CSV of thread names excluded from stalls
   } synth;
 
 
@@ -972,9 +3420,12 @@ struct Registry {
     process_name[0] = '\0';
     std::snprintf(default_path, sizeof(default_path), "%s", OTRACE_DEFAULT_PATH);
     allow_cats[0]=deny_cats[0]=pattern[0]='\0';
+    std::snprintf(downsample, sizeof(downsample), "%s", OTRACE_COUNTER_DOWNSAMPLE);
     // synth defaults
     synth.rate_window_us = (uint64_t)OTRACE_SYNTH_RATE_WINDOW_US;
     synth.pct_count = 0;
+    synth.stall_us = (uint64_t)OTRACE_SYNTH_STALL_US;
+    std::snprintf(synth.idle_threads, sizeof(synth.idle_threads), "%s", OTRACE_SYNTH_IDLE_THREADS);
     // parse OTRACE_SYNTH_PCT_NAMES at startup
     {
       const char* csv = OTRACE_SYNTH_PCT_NAMES;
@@ -1114,6 +3565,9 @@ inline void write_event_json_common(FILE* f, const E& e) {
   // color hint
   if (e.cname[0]) { std::fputs(",\"cname\":", f); json_escape_and_write(f, e.cname); }
 
+  // stack (stackFrames id)
+  if (e.sf) std::fprintf(f, ",\"sf\":%" PRIu32, e.sf);
+
   // args
   if (e.ph == Phase::MThreadName || e.ph == Phase::MProcessName) {
     std::fputs(",\"args\":{\"name\":", f); json_escape_and_write(f, e.name); std::fputc('}', f);
@@ -1130,6 +3584,59 @@ inline void write_event_json_common(FILE* f, const E& e) {
 }
 inline void write_event_json(FILE* f, const Event& e)      { write_event_json_common(f, e); }
     
+#if OTRACE_SCOPE_STATS
+// ---- Live statistics: owner-thread updates --------------------------------
+inline StatsTable* stats_table() {
+  ThreadBuffer* tb = get_tbuf();
+  StatsTable* t = tb->stats.load(std::memory_order_relaxed);
+  if (!t) { t = new StatsTable(); tb->stats.store(t, std::memory_order_release); }
+  return t;
+}
+
+// Update of the live aggregate for one finished scope.
+inline void stats_record_scope(const char* name, const char* cat, uint64_t dur) {
+  if (!name) return;
+  StatsTable* t = stats_table();
+  bool fresh = false;
+  ScopeSlot* sl = stats_find(t->scopes, name, cat, &fresh);
+  if (!sl) { t->dropped.fetch_add(1, std::memory_order_relaxed); return; }
+  if (fresh) sl->key.store(name, std::memory_order_release);
+
+  const uint64_t c = sl->count.load(std::memory_order_relaxed);
+  t->begin_write();
+  sl->count.store(c + 1, std::memory_order_relaxed);
+  sl->total_us.store(sl->total_us.load(std::memory_order_relaxed) + dur, std::memory_order_relaxed);
+  if (c == 0 || dur < sl->min_us.load(std::memory_order_relaxed)) sl->min_us.store(dur, std::memory_order_relaxed);
+  if (dur > sl->max_us.load(std::memory_order_relaxed)) sl->max_us.store(dur, std::memory_order_relaxed);
+  auto& hb = sl->hist[stats_bucket(dur)];
+  hb.store(hb.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  t->end_write();
+}
+
+// Owner-thread update of a counter's last values. Series names are fixed by the
+// first sample seen for that counter on this thread.
+inline void stats_record_counter(const char* name, const char* cat, int n,
+                                 const char** keys, const double* vals, uint64_t ts) {
+  if (!name) return;
+  StatsTable* t = stats_table();
+  bool fresh = false;
+  CounterSlot* sl = stats_find(t->counters, name, cat, &fresh);
+  if (!sl) { t->dropped.fetch_add(1, std::memory_order_relaxed); return; }
+  if (fresh) {
+    sl->nseries = 0;
+    for (int i = 0; i < n && i < (int)OTRACE_MAX_ARGS; ++i) {
+      std::snprintf(sl->series[sl->nseries++], OTRACE_MAX_ARGK, "%s", keys[i] ? keys[i] : name);
+    }
+    sl->key.store(name, std::memory_order_release);
+  }
+  t->begin_write();
+  for (int i = 0; i < n && i < (int)sl->nseries; ++i) sl->vals[i].store(vals[i], std::memory_order_relaxed);
+  sl->ts_us.store(ts, std::memory_order_relaxed);
+  sl->updates.store(sl->updates.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  t->end_write();
+}
+#endif // OTRACE_SCOPE_STATS
+
 // ---- Emit helpers ---------------------------------------------------------
 
 inline void arg_number(Event& e, const char* key, double val) {
@@ -1154,6 +3661,7 @@ inline void fill_common(Event& e, Phase ph, const char* name, const char* cat) {
   e.pid = reg().pid_v;
   e.tid = get_tbuf()->tid_v;
   e.ph = ph;
+  e.sf = 0;
   e.name[0] = e.cat[0] = '\0';
   if (name) { std::snprintf(e.name, sizeof(e.name), "%s", name); }
   if (cat)  { std::snprintf(e.cat,  sizeof(e.cat),  "%s", cat); }
@@ -1227,6 +3735,9 @@ inline void emit_counter_n(const char* name, const char* cat, int n, const char*
   // ensure the primary series exists: if no keys provided, use event name as key
   if (n==0) arg_number(*ev, name, 0.0);
   commit(ev);
+#if OTRACE_SCOPE_STATS
+  stats_record_counter(name, cat, n, keys, vals, ev->ts_us);
+#endif
 }
 
 inline void emit_complete(const char* name, uint64_t dur_us, const char* cat=nullptr) {
@@ -1250,6 +3761,23 @@ inline void emit_complete_kv(const char* name, uint64_t dur_us, const char* key,
   commit(ev);
 }
 
+#if OTRACE_HEAP && OTRACE_HEAP_SCOPES
+// Scope end carrying the allocations charged to it (plus the scope's own arg)
+inline void emit_complete_allocs(const char* name, uint64_t dur_us, const char* cat,
+                                 const char* key, double val, uint64_t count, uint64_t bytes) {
+  otrace::TracerGuard _tg;
+  if (!should_emit(name, cat)) return;
+  if (!enabled()) return;
+  Event* ev = get_tbuf()->append();
+  fill_common(*ev, Phase::X, name, cat);
+  ev->dur_us = dur_us;
+  if (key) arg_number(*ev, key, val);
+  arg_number(*ev, "alloc_count", (double)count);
+  arg_number(*ev, "alloc_bytes", (double)bytes);
+  commit(ev);
+}
+#endif
+
 // ---- Variadic KV helpers for instants (numbers and strings) ----
 // String-like overloads first
     
@@ -1297,6 +3825,39 @@ inline void emit_instant_kvs(const char* name, const char* cat, KVs&&... kvs) {
   commit(ev);
 }
 
+template <class... KVs>
+inline void emit_instant_sf(uint32_t sf, const char* name, const char* cat, KVs&&... kvs) {
+  static_assert(sizeof...(kvs) % 2 == 0, "emit_instant_sf expects key/value pairs");
+  otrace::TracerGuard _tg;
+  if (!should_emit(name, cat)) return;
+  if (!enabled()) return;
+  Event* ev = get_tbuf()->append();
+  fill_common(*ev, Phase::I, name, cat);
+  ev->sf = sf;
+  if constexpr (sizeof...(kvs) > 0) {
+    otrace_add_kvs(*ev, std::forward<KVs>(kvs)...);
+  }
+  commit(ev);
+}
+
+// Id of the frame `name` under `parent` (0 = root) in the stackFrames
+// dictionary written with the trace; equal paths share ids. Returns `parent`
+// once OTRACE_MAX_STACK_FRAMES frames exist, so stacks are cut short rather
+// than dropped.
+inline uint32_t intern_stack_frame(uint32_t parent, const char* name, const char* cat) {
+  otrace::TracerGuard _tg;
+  Registry& R = reg();
+  std::lock_guard<std::mutex> lk(R.sf_mu);
+  auto key = std::make_pair(parent, std::string(name ? name : "?"));
+  auto it = R.stack_frame_ids.find(key);
+  if (it != R.stack_frame_ids.end()) return it->second;
+  if (R.stack_frames.size() >= (size_t)OTRACE_MAX_STACK_FRAMES) return parent;
+  R.stack_frames.push_back({key.second, cat ? cat : "", parent});
+  const uint32_t id = (uint32_t)R.stack_frames.size();
+  R.stack_frame_ids.emplace(std::move(key), id);
+  return id;
+}
+
 inline void emit_thread_name(const char* name) {
   if (!enabled()) return;
   ThreadBuffer* tb = get_tbuf();
@@ -1350,30 +3911,482 @@ struct Scope {
   bool has_arg;
   bool record;        
   uint64_t t0;
+#if OTRACE_HEAP && OTRACE_HEAP_SCOPES
+  heap::ScopeAlloc alloc;   // allocations made while this is the innermost scope
+#endif
+
+  Scope(const char* nm, const char* ct=nullptr)
+  : name(nm), cat(ct), arg_key(nullptr), arg_val(0), has_arg(false) {
+    otrace::TracerGuard _tg;  
+    record = should_emit(name, cat);
+    t0 = record ? now_us() : 0;
+#if OTRACE_HEAP && OTRACE_HEAP_SCOPES
+    if (record) heap::scope_push(alloc);
+#endif
+  }
+
+  Scope(const char* nm, const char* ct, const char* key, double val)
+  : name(nm), cat(ct), arg_key(key), arg_val(val), has_arg(true) {
+    otrace::TracerGuard _tg;  
+    record = should_emit(name, cat);
+    t0 = record ? now_us() : 0;
+#if OTRACE_HEAP && OTRACE_HEAP_SCOPES
+    if (record) heap::scope_push(alloc);
+#endif
+  }
+
+  ~Scope() {
+    otrace::TracerGuard _tg;  
+    if (!record) return;
+    uint64_t dur = now_us() - t0;
+#if OTRACE_SCOPE_STATS
+    stats_record_scope(name, cat, dur);
+#endif
+#if OTRACE_HEAP && OTRACE_HEAP_SCOPES
+    heap::scope_pop(alloc, name, cat);
+    if (alloc.count) {
+      emit_complete_allocs(name, dur, cat, has_arg ? arg_key : nullptr, arg_val, alloc.count, alloc.bytes);
+      return;
+    }
+#endif
+    if (has_arg) emit_complete_kv(name, dur, arg_key, arg_val, cat);
+    else         emit_complete(name, dur, cat);
+  }
+
+  // The heap layer keeps a pointer to `alloc` while the scope is open
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+  Scope(Scope&&) = delete;
+  Scope& operator=(Scope&&) = delete;
+};
+
+
+#if OTRACE_SCOPE_STATS
+// ---- Live scope statistics: readers ---------------------------------------
+
+// Run `read` until it observed the table outside of an owner update.
+template <class Fn>
+inline void stats_read(StatsTable* t, Fn&& read) {
+  for (;;) {
+    const uint32_t s1 = t->seq.load(std::memory_order_acquire);
+    if (s1 & 1u) { std::this_thread::yield(); continue; }
+    read();
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (t->seq.load(std::memory_order_relaxed) == s1) return;
+  }
+}
+
+// Cumulative aggregates since start, merged over all (including exited) threads
+// by name/category. Safe to call from any thread while recording continues.
+inline void scope_stats_snapshot(std::vector<ScopeStat>& out) {
+  otrace::TracerGuard _tg;
+  std::map<std::pair<std::string, std::string>, ScopeStat> merged;
+  for (ThreadBuffer* tb = reg().head.load(std::memory_order_acquire); tb; tb = tb->next) {
+    StatsTable* t = tb->stats.load(std::memory_order_acquire);
+    if (!t) continue;
+    for (uint32_t i = 0; i < OTRACE_SCOPE_STATS_SLOTS; ++i) {
+      ScopeSlot& sl = t->scopes[i];
+      if (!sl.key.load(std::memory_order_acquire)) continue;
+      ScopeStat one;
+      stats_read(t, [&]{
+        one.count    = sl.count.load(std::memory_order_relaxed);
+        one.total_us = sl.total_us.load(std::memory_order_relaxed);
+        one.min_us   = sl.min_us.load(std::memory_order_relaxed);
+        one.max_us   = sl.max_us.load(std::memory_order_relaxed);
+        for (int b = 0; b < OTRACE_STATS_BUCKETS; ++b) one.hist[b] = sl.hist[b].load(std::memory_order_relaxed);
+      });
+      if (!one.count) continue;
+      ScopeStat& m = merged[{sl.name, sl.cat}];
+      if (m.count == 0) { m.name = sl.name; m.cat = sl.cat; m.min_us = one.min_us; }
+      else if (one.min_us < m.min_us) m.min_us = one.min_us;
+      if (one.max_us > m.max_us) m.max_us = one.max_us;
+      m.count    += one.count;
+      m.total_us += one.total_us;
+      for (int b = 0; b < OTRACE_STATS_BUCKETS; ++b) m.hist[b] += one.hist[b];
+    }
+  }
+  out.clear();
+  out.reserve(merged.size());
+  for (auto& kv : merged) out.push_back(std::move(kv.second));
+}
+
+// Aggregates accumulated since the previous call with the same cursor, which
+// then advances. min/max of an interval are bounded by its histogram buckets.
+// A cursor is not synchronized; share one between threads only under a lock.
+inline void scope_stats_delta(ScopeStatsCursor& cursor, std::vector<ScopeStat>& out) {
+  std::vector<ScopeStat> cur;
+  scope_stats_snapshot(cur);
+
+  otrace::TracerGuard _tg;
+  auto& last = cursor.last;
+  out.clear();
+  for (auto& c : cur) {
+    auto key = std::make_pair(c.name, c.cat);
+    ScopeStat d = c;
+    auto it = last.find(key);
+    if (it != last.end()) {
+      d.count    -= it->second.count;
+      d.total_us -= it->second.total_us;
+      for (int b = 0; b < OTRACE_STATS_BUCKETS; ++b) d.hist[b] -= it->second.hist[b];
+    }
+    last[key] = c;
+    if (!d.count) continue;
+    int lo = 0, hi = OTRACE_STATS_BUCKETS - 1;
+    while (!d.hist[lo]) ++lo;
+    while (!d.hist[hi]) --hi;
+    const uint64_t lo_us = lo ? (1ull << (lo - 1)) : 0;
+    const uint64_t hi_us = hi ? (1ull << hi) - 1 : 0;
+    d.min_us = lo_us > c.min_us ? lo_us : c.min_us;
+    d.max_us = hi_us < c.max_us ? hi_us : c.max_us;
+    out.push_back(std::move(d));
+  }
+}
+
+// Last counter values, merged over all threads by name/category (newest wins).
+inline void counter_stats_snapshot(std::vector<CounterStat>& out) {
+  otrace::TracerGuard _tg;
+  std::map<std::pair<std::string, std::string>, CounterStat> merged;
+  for (ThreadBuffer* tb = reg().head.load(std::memory_order_acquire); tb; tb = tb->next) {
+    StatsTable* t = tb->stats.load(std::memory_order_acquire);
+    if (!t) continue;
+    for (uint32_t i = 0; i < OTRACE_SCOPE_STATS_SLOTS; ++i) {
+      CounterSlot& sl = t->counters[i];
+      if (!sl.key.load(std::memory_order_acquire)) continue;
+      double vals[OTRACE_MAX_ARGS] = {};
+      uint64_t ts = 0, updates = 0;
+      stats_read(t, [&]{
+        for (int k = 0; k < sl.nseries; ++k) vals[k] = sl.vals[k].load(std::memory_order_relaxed);
+        ts      = sl.ts_us.load(std::memory_order_relaxed);
+        updates = sl.updates.load(std::memory_order_relaxed);
+      });
+      if (!updates) continue;
+      CounterStat& m = merged[{sl.name, sl.cat}];
+      m.updates += updates;
+      if (m.keys.empty() || ts >= m.ts_us) {
+        m.name = sl.name; m.cat = sl.cat; m.ts_us = ts;
+        m.keys.assign(sl.series, sl.series + sl.nseries);
+        m.values.assign(vals, vals + sl.nseries);
+      }
+    }
+  }
+  out.clear();
+  out.reserve(merged.size());
+  for (auto& kv : merged) out.push_back(std::move(kv.second));
+}
+
+// ---- Metrics exposition (Prometheus text format 0.0.4) --------------------
+
+inline void metrics_label(std::string& out, const std::string& v) {
+  out += '"';
+  for (char c : v) {
+    if (c == '\\' || c == '"') { out += '\\'; out += c; }
+    else if (c == '\n') out += "\\n";
+    else out += c;
+  }
+  out += '"';
+}
+
+// Sample value as Prometheus spells it: printf's nan/inf are not valid there
+inline void metrics_value(std::string& out, double v) {
+  char num[32];
+  if (std::isnan(v)) out += "NaN";
+  else if (std::isinf(v)) out += v > 0 ? "+Inf" : "-Inf";
+  else { std::snprintf(num, sizeof(num), "%.17g", v); out += num; }
+}
+
+// Render the current scope and counter aggregates as Prometheus text.
+inline void metrics_text(std::string& out) {
+  std::vector<ScopeStat> scopes;
+  std::vector<CounterStat> counters;
+  scope_stats_snapshot(scopes);
+  counter_stats_snapshot(counters);
+
+  otrace::TracerGuard _tg;
+  char num[64];
+  auto labels = [&](const std::string& name, const std::string& cat) {
+    out += "{name="; metrics_label(out, name);
+    out += ",cat=";  metrics_label(out, cat);
+  };
+  out.clear();
+  out += "# HELP otrace_scope_duration_us Duration of finished scopes in microseconds.\n";
+  out += "# TYPE otrace_scope_duration_us summary\n";
+  static const double qs[] = { 0.5, 0.9, 0.99 };
+  for (auto& s : scopes) {
+    for (double q : qs) {
+      out += "otrace_scope_duration_us"; labels(s.name, s.cat);
+      std::snprintf(num, sizeof(num), ",quantile=\"%g\"} %.6g\n", q, s.percentile_us(q)); out += num;
+    }
+    out += "otrace_scope_duration_us_sum"; labels(s.name, s.cat);
+    std::snprintf(num, sizeof(num), "} %" PRIu64 "\n", s.total_us); out += num;
+    out += "otrace_scope_duration_us_count"; labels(s.name, s.cat);
+    std::snprintf(num, sizeof(num), "} %" PRIu64 "\n", s.count); out += num;
+  }
+  out += "# HELP otrace_scope_duration_max_us Longest finished scope in microseconds.\n";
+  out += "# TYPE otrace_scope_duration_max_us gauge\n";
+  for (auto& s : scopes) {
+    out += "otrace_scope_duration_max_us"; labels(s.name, s.cat);
+    std::snprintf(num, sizeof(num), "} %" PRIu64 "\n", s.max_us); out += num;
+  }
+  out += "# HELP otrace_counter Last value of a trace counter series.\n";
+  out += "# TYPE otrace_counter gauge\n";
+  for (auto& c : counters) {
+    for (size_t k = 0; k < c.keys.size(); ++k) {
+      out += "otrace_counter"; labels(c.name, c.cat);
+      out += ",series="; metrics_label(out, c.keys[k]);
+      out += "} "; metrics_value(out, c.values[k]); out += '\n';
+    }
+  }
+  uint64_t dropped = 0;
+  for (ThreadBuffer* tb = reg().head.load(std::memory_order_acquire); tb; tb = tb->next) {
+    if (StatsTable* t = tb->stats.load(std::memory_order_acquire)) dropped += t->dropped.load(std::memory_order_relaxed);
+  }
+  out += "# HELP otrace_stats_dropped_total Updates lost because a per-thread stats table was full.\n";
+  out += "# TYPE otrace_stats_dropped_total counter\n";
+  std::snprintf(num, sizeof(num), "otrace_stats_dropped_total %" PRIu64 "\n", dropped); out += num;
+}
+
+// Atomically replace `path` with `text` (write .tmp, then rename).
+inline bool metrics_write_file(const char* path, const std::string& text) {
+  char tmp[512];
+  std::snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  otrace::mkpath(path);
+  FILE* f = std::fopen(tmp, "wb");
+  if (!f) return false;
+  bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+  if (std::fclose(f) != 0) ok = false;
+#if defined(_WIN32)
+  std::remove(path);
+#endif
+  if (!ok || std::rename(tmp, path) != 0) { std::remove(tmp); return false; }
+  return true;
+}
+
+#if !defined(_WIN32)
+// Reply to one accepted Unix-socket client: an HTTP/1.0 response if it sent a
+// request line (curl --unix-socket), otherwise the raw exposition text (nc -U).
+inline void metrics_serve_client(int fd, const std::string& text) {
+  char req[512];
+  ssize_t n = 0;
+  pollfd pf{ fd, POLLIN, 0 };
+  if (::poll(&pf, 1, 50) > 0) n = ::recv(fd, req, sizeof(req), 0);
+  std::string reply;
+  if (n >= 4 && std::memcmp(req, "GET ", 4) == 0) {
+    char hdr[160];
+    std::snprintf(hdr, sizeof(hdr),
+                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                  text.size());
+    reply = hdr;
+  }
+  reply += text;
+#if defined(MSG_NOSIGNAL)
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif
+  for (size_t off = 0; off < reply.size();) {
+    ssize_t w = ::send(fd, reply.data() + off, reply.size() - off, flags);
+    if (w <= 0) break;
+    off += (size_t)w;
+  }
+}
+#endif
+
+// Exporter thread body: re-merge aggregates every metrics_ms and publish them.
+inline void metrics_loop() {
+  otrace::tls_in_tracer = true;   // nothing this thread allocates is heap-traced
+  Registry& R = reg();
+  const char* target = R.metrics_target;
+  const bool sock = std::strncmp(target, "unix:", 5) == 0;
+  int lfd = -1;
+#if !defined(_WIN32)
+  if (sock) {
+    const char* spath = target + 5;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", spath);
+    ::unlink(spath);
+    lfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd >= 0 && (::bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(lfd, 8) != 0)) {
+      ::close(lfd); lfd = -1;
+    }
+    if (lfd < 0) return;
+  }
+#else
+  if (sock) return;   // Unix sockets are POSIX-only here
+#endif
+
+  std::string text;
+  while (!R.metrics_stop.load(std::memory_order_acquire)) {
+    metrics_text(text);
+    if (!sock) metrics_write_file(target, text);
+    const uint64_t until = now_us() + (uint64_t)R.metrics_ms * 1000u;
+    while (!R.metrics_stop.load(std::memory_order_acquire)) {
+      const uint64_t now = now_us();
+      if (now >= until) break;
+      const int wait_ms = (int)std::min<uint64_t>((until - now) / 1000u + 1, 100);
+#if !defined(_WIN32)
+      if (lfd >= 0) {
+        pollfd pf{ lfd, POLLIN, 0 };
+        if (::poll(&pf, 1, wait_ms) > 0) {
+          int cfd = ::accept(lfd, nullptr, nullptr);
+          if (cfd >= 0) { metrics_serve_client(cfd, text); ::close(cfd); }
+        }
+        continue;
+      }
+#endif
+      std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+    }
+  }
+#if !defined(_WIN32)
+  if (lfd >= 0) { ::close(lfd); ::unlink(target + 5); }
+#endif
+}
+
+inline void metrics_stop() {
+  Registry& R = reg();
+  R.metrics_stop.store(true, std::memory_order_release);
+  if (R.metrics_thr.joinable()) R.metrics_thr.join();
+}
+
+// Start (or restart) the exporter. `target` is a file path, rewritten atomically
+// every interval, or "unix:<path>" to serve the text on a local Unix socket.
+inline void metrics_start(const char* target, uint32_t interval_ms) {
+  if (!target || !target[0]) return;
+  metrics_stop();
+  Registry& R = reg();
+  std::snprintf(R.metrics_target, sizeof(R.metrics_target), "%s", target);
+  R.metrics_ms = interval_ms ? interval_ms : 1000;
+  R.metrics_stop.store(false, std::memory_order_release);
+  static bool at_exit = (std::atexit(metrics_stop), true);   // join before statics go away
+  (void)at_exit;
+  otrace::TracerGuard _tg;
+  R.metrics_thr = std::thread(metrics_loop);
+}
+#endif // OTRACE_SCOPE_STATS
+
+// ---- Process memory sampler -------------------------------------------------
+
+#if !defined(_WIN32)
+// Reads a small /proc file into `buf` (NUL-terminated) without allocating
+inline size_t read_proc_file(const char* path, char* buf, size_t cap) {
+  const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) { buf[0] = '\0'; return 0; }
+  size_t n = 0;
+  while (n + 1 < cap) {
+    const ssize_t r = ::read(fd, buf + n, cap - 1 - n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    n += (size_t)r;
+  }
+  ::close(fd);
+  buf[n] = '\0';
+  return n;
+}
+
+// Bytes in a "Key:   123 kB" line of /proc/self/status, or -1 if absent
+inline double proc_status_bytes(const char* text, const char* key) {
+  const size_t k = std::strlen(key);
+  for (const char* line = text; line && *line; line = std::strchr(line, '\n'), line = line ? line + 1 : nullptr)
+    if (std::strncmp(line, key, k) == 0 && line[k] == ':')
+      return (double)std::strtoull(line + k + 1, nullptr, 10) * 1024.0;
+  return -1.0;
+}
+#endif
+
+// Sampler thread body: every mem_ms, read the kernel's and the allocator's
+// view of the process and emit them as counter tracks.
+inline void memory_sampler_loop() {
+  otrace::tls_in_tracer = true;   // nothing this thread allocates is heap-traced
+  Registry& R = reg();
+#if !defined(_WIN32)
+  const double page = (double)::sysconf(_SC_PAGESIZE);
+  char buf[4096];
+  uint64_t last = 0;
+  long last_minflt = 0, last_majflt = 0;
+  while (!R.mem_stop.load(std::memory_order_acquire)) {
+    const uint64_t now = now_us();
+
+#if defined(__linux__)
+    // statm: size resident shared text lib data dt, in pages
+    if (read_proc_file("/proc/self/statm", buf, sizeof(buf))) {
+      unsigned long long size = 0, resident = 0, shared = 0, text = 0, lib = 0, data = 0;
+      if (std::sscanf(buf, "%llu %llu %llu %llu %llu %llu", &size, &resident, &shared, &text, &lib, &data) == 6) {
+        const char* k[] = { "rss_bytes", "vm_bytes", "shared_bytes", "data_bytes" };
+        const double v[] = { resident * page, size * page, shared * page, data * page };
+        emit_counter_n("process_memory", "process", 4, k, v);
+      }
+    }
+    if (read_proc_file("/proc/self/status", buf, sizeof(buf))) {
+      const char* keys[] = { "RssAnon", "RssFile", "VmHWM", "VmSwap" };
+      const char* k[] = { "rss_anon_bytes", "rss_file_bytes", "peak_rss_bytes", "swap_bytes" };
+      double v[4];
+      int n = 0;
+      for (int i = 0; i < 4; ++i) {
+        const double b = proc_status_bytes(buf, keys[i]);
+        if (b >= 0.0) { k[n] = k[i]; v[n++] = b; }
+      }
+      if (n) emit_counter_n("process_memory_status", "process", n, k, v);
+    }
+#endif
 
-  Scope(const char* nm, const char* ct=nullptr)
-  : name(nm), cat(ct), arg_key(nullptr), arg_val(0), has_arg(false) {
-    otrace::TracerGuard _tg;  
-    record = should_emit(name, cat);
-    t0 = record ? now_us() : 0;
-  }
+    struct rusage ru;
+    if (::getrusage(RUSAGE_SELF, &ru) == 0) {
+      const double secs = (double)(now - last) / 1e6;
+      if (last && secs > 0.0) {
+        const char* k[] = { "minor_per_s", "major_per_s" };
+        const double v[] = { (double)(ru.ru_minflt - last_minflt) / secs, (double)(ru.ru_majflt - last_majflt) / secs };
+        emit_counter_n("process_page_faults", "process", 2, k, v);
+      }
+      last_minflt = ru.ru_minflt;
+      last_majflt = ru.ru_majflt;
+      last = now;
+    }
 
-  Scope(const char* nm, const char* ct, const char* key, double val)
-  : name(nm), cat(ct), arg_key(key), arg_val(val), has_arg(true) {
-    otrace::TracerGuard _tg;  
-    record = should_emit(name, cat);
-    t0 = record ? now_us() : 0;
-  }
+#if OTRACE_HAVE_MALLINFO2
+    {
+      // Takes every arena lock; fine at sampler intervals, not on a hot path
+      const struct mallinfo2 mi = ::mallinfo2();
+      const char* k[] = { "system_bytes", "in_use_bytes", "free_bytes", "releasable_bytes" };
+      const double v[] = { (double)(mi.arena + mi.hblkhd), (double)(mi.uordblks + mi.hblkhd),
+                           (double)mi.fordblks, (double)mi.keepcost };
+      emit_counter_n("malloc_stats", "process", 4, k, v);
+    }
+#endif
 
-  ~Scope() {
-    otrace::TracerGuard _tg;  
-    if (!record) return;
-    uint64_t dur = now_us() - t0;
-    if (has_arg) emit_complete_kv(name, dur, arg_key, arg_val, cat);
-    else         emit_complete(name, dur, cat);
+    const uint64_t until = now + (uint64_t)R.mem_ms * 1000u;
+    while (!R.mem_stop.load(std::memory_order_acquire)) {
+      const uint64_t t = now_us();
+      if (t >= until) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(std::min<uint64_t>((until - t) / 1000u + 1, 100)));
+    }
   }
-};
+#else
+  (void)R;   // no /proc or getrusage here
+#endif
+}
 
+inline void memory_sampler_stop() {
+  Registry& R = reg();
+  R.mem_stop.store(true, std::memory_order_release);
+  if (R.mem_thr.joinable()) R.mem_thr.join();
+}
+
+// Start (or restart) the process memory sampler. Counters are emitted every
+// `interval_ms` from a background thread; the recorder's hot path is untouched.
+inline void memory_sampler_start(uint32_t interval_ms) {
+#if !defined(_WIN32)
+  memory_sampler_stop();
+  Registry& R = reg();
+  R.mem_ms = interval_ms ? interval_ms : 100;
+  R.mem_stop.store(false, std::memory_order_release);
+  static bool at_exit = (std::atexit(memory_sampler_stop), true);   // join before statics go away
+  (void)at_exit;
+  otrace::TracerGuard _tg;
+  R.mem_thr = std::thread(memory_sampler_loop);
+#else
+  (void)interval_ms;
+#endif
+}
 
 // ---- Flush ----------------------------------------------------------------
 
@@ -1386,6 +4399,7 @@ struct CleanEvent {
   char cat[OTRACE_MAX_CAT];
   char cname[OTRACE_MAX_CNAME];
   uint8_t argc; Arg args[OTRACE_MAX_ARGS];
+  uint32_t sf;
 
 };
     
@@ -1414,6 +4428,7 @@ inline void collect_all(std::vector<CleanEvent>& out) {
       std::snprintf(ce.cname,sizeof(ce.cname),"%s",src->cname);
       ce.argc = src->argc;
       for (uint8_t a=0;a<ce.argc && a<OTRACE_MAX_ARGS;a++){ ce.args[a]=src->args[a]; }
+      ce.sf = src->sf;
       out.push_back(ce);
     }
     // emit metadata for thread name/sort index once per flush (viewer is idempotent)
@@ -1434,6 +4449,10 @@ inline void collect_all(std::vector<CleanEvent>& out) {
 
 // ---- Synthetic tracks at flush (optional) ---------------------------------
 #if OTRACE_SYNTHESIZE_TRACKS
+// Synthetic per-thread rows live on tid 0x40000000|tid so they never collide
+// with real thread ids.
+inline uint32_t synth_track_tid(uint32_t tid) { return 0x40000000u | (tid & 0x3FFFFFFFu); }
+
 inline void synthesize_tracks(const std::vector<CleanEvent>& in,
                               std::vector<CleanEvent>& out,
                               const Registry::SynthCfg& cfg) {
@@ -1539,6 +4558,77 @@ inline void synthesize_tracks(const std::vector<CleanEvent>& in,
       }
     }
   }
+
+  // Stalls: idle gaps between consecutive top-level slices on a thread.
+  // Each gap >= cfg.stall_us becomes a "stall" slice on a per-thread synthetic
+  // track, and a cumulative stall_ms(<thread>) counter steps at every gap.
+  if (cfg.stall_us > 0) {
+    std::map<uint32_t, std::string> tnames;
+    for (auto& e : in) if (e.ph == Phase::MThreadName) tnames[e.tid] = e.name;
+
+    struct Top { uint64_t t0, t1; const char* name; };
+    std::map<uint32_t, std::vector<Top>> tops;     // tid -> slices (X, or outermost B/E pairs)
+    {
+      std::map<uint32_t, uint32_t> depth;          // open B/E nesting per tid
+      std::map<uint32_t, Top> open;                // outermost open B per tid
+      for (auto& e : in) {
+        if (e.ph == Phase::X) {
+          tops[e.tid].push_back({e.ts_us, e.ts_us + e.dur_us, e.name});
+        } else if (e.ph == Phase::B) {
+          if (depth[e.tid]++ == 0) open[e.tid] = {e.ts_us, e.ts_us, e.name};
+        } else if (e.ph == Phase::E) {
+          uint32_t& d = depth[e.tid];
+          if (d && --d == 0) { Top t = open[e.tid]; t.t1 = e.ts_us; tops[e.tid].push_back(t); }
+        }
+      }
+    }
+
+    for (auto& kv : tops) {
+      const uint32_t tid = kv.first;
+      auto it = tnames.find(tid);
+      std::string label = (it != tnames.end() && !it->second.empty()) ? it->second : std::to_string(tid);
+      if (it != tnames.end() && csv_has(cfg.idle_threads, it->second.c_str())) continue;
+
+      auto& v = kv.second;
+      if (v.size() < 2) continue;
+      std::stable_sort(v.begin(), v.end(), [](const Top& a, const Top& b){ return a.t0 < b.t0; });
+
+      const uint32_t stid = synth_track_tid(tid);
+      char cname[OTRACE_MAX_NAME];
+      std::snprintf(cname, sizeof(cname), "stall_ms(%s)", label.c_str());
+      uint64_t end = v[0].t1;
+      const char* last = v[0].name;
+      double total_ms = 0.0;
+      bool any = false;
+      for (size_t i = 1; i < v.size(); ++i) {
+        if (v[i].t0 > end && v[i].t0 - end >= cfg.stall_us) {
+          const uint64_t gap = v[i].t0 - end;
+          CleanEvent ce{}; ce.ts_us=end; ce.dur_us=gap; ce.pid=pid; ce.tid=stid; ce.ph=Phase::X;
+          std::snprintf(ce.name, sizeof(ce.name), "stall");
+          std::snprintf(ce.cat,  sizeof(ce.cat),  "synth");
+          const char* keys[2] = { "after", "before" };
+          const char* vals[2] = { last, v[i].name };
+          for (int k = 0; k < 2 && ce.argc < OTRACE_MAX_ARGS; ++k) {
+            Arg& a = ce.args[ce.argc++];
+            std::snprintf(a.key, sizeof(a.key), "%s", keys[k]);
+            a.kind = ArgKind::String; std::snprintf(a.str, sizeof(a.str), "%s", vals[k]);
+          }
+          out.push_back(ce);
+
+          emit_counter(end, cname, "ms", total_ms, pid, 0, "synth");
+          total_ms += (double)gap / 1000.0;
+          emit_counter(v[i].t0, cname, "ms", total_ms, pid, 0, "synth");
+          any = true;
+        }
+        if (v[i].t1 > end) { end = v[i].t1; last = v[i].name; }
+      }
+      if (any) {
+        CleanEvent m{}; m.pid = pid; m.tid = stid; m.ph = Phase::MThreadName;
+        std::snprintf(m.name, sizeof(m.name), "stall: %s", label.c_str());
+        out.push_back(m);
+      }
+    }
+  }
 }
 #endif // OTRACE_SYNTHESIZE_TRACKS
 
@@ -1547,6 +4637,159 @@ inline void synthesize_tracks(const std::vector<CleanEvent>& in,
 
 
 
+// Remove events flagged in `drop`, keeping the order of the rest.
+inline void erase_dropped(std::vector<CleanEvent>& all, const std::vector<uint8_t>& drop) {
+  size_t w = 0;
+  for (size_t i = 0; i < all.size(); ++i) if (!drop[i]) { if (w != i) all[w] = all[i]; ++w; }
+  all.resize(w);
+}
+
+// ---- Counter downsampling at flush ----------------------------------------
+// Rules are "key=points" pairs; key matches a counter's name or category, "*"
+// matches everything, and the first matching rule wins.
+inline uint32_t downsample_budget(const char* rules, const char* name, const char* cat) {
+  const char* p = rules;
+  while (p && *p) {
+    while (*p==',' || *p==' ' || *p=='\t') ++p;
+    const char* k = p;
+    while (*p && *p!='=' && *p!=',') ++p;
+    size_t kn = (size_t)(p - k);
+    uint32_t pts = 0;
+    if (*p == '=') { pts = (uint32_t)std::strtoul(p + 1, nullptr, 10); while (*p && *p!=',') ++p; }
+    if (kn && pts) {
+      if ((kn==1 && *k=='*') ||
+          (std::strlen(name)==kn && std::strncmp(name, k, kn)==0) ||
+          (std::strlen(cat)==kn  && std::strncmp(cat,  k, kn)==0)) return pts;
+    }
+    if (*p == ',') ++p;
+  }
+  return 0;
+}
+
+// Thin each counter row that exceeds its budget: split its time span into equal
+// buckets and keep, per bucket, the samples holding the min and max of every
+// series (plus each series' first and last sample). A series is one arg key of
+// the row, so samples that carry only some of the keys are compared correctly.
+// Spikes survive; flat runs collapse.
+// `all` must be time-sorted; relative order of kept events is preserved.
+inline void downsample_counters(std::vector<CleanEvent>& all, const char* rules) {
+  if (!rules || !rules[0]) return;
+  std::map<std::string, std::vector<size_t>> rows;   // counter name -> indices
+  for (size_t i = 0; i < all.size(); ++i) {
+    if (all[i].ph == Phase::C && all[i].argc) rows[all[i].name].push_back(i);
+  }
+  std::vector<uint8_t> drop(all.size(), 0);
+  bool any = false;
+  struct Point { size_t at; double v; };
+  std::map<std::string, std::vector<Point>> series;   // arg key -> samples, per row
+  for (auto& kv : rows) {
+    auto& idx = kv.second;
+    const CleanEvent& first = all[idx.front()];
+    const uint32_t budget = downsample_budget(rules, first.name, first.cat);
+    if (!budget || idx.size() <= budget) continue;
+
+    series.clear();
+    for (size_t i : idx)
+      for (uint8_t a = 0; a < all[i].argc; ++a) series[all[i].args[a].key].push_back(Point{i, all[i].args[a].num});
+    const size_t buckets = std::max<size_t>(1, budget / (2 * series.size()));
+    const uint64_t t0 = all[idx.front()].ts_us, t1 = all[idx.back()].ts_us;
+    const uint64_t span = (t1 > t0) ? (t1 - t0) : 1;
+    auto bucket_of = [&](size_t i) { return (size_t)((double)(all[i].ts_us - t0) / (double)span * (double)buckets); };
+
+    for (size_t i : idx) drop[i] = 1;
+    for (const auto& sv : series) {
+      const std::vector<Point>& pts = sv.second;
+      drop[pts.front().at] = drop[pts.back().at] = 0;
+      size_t lo = 0;
+      while (lo < pts.size()) {
+        const size_t b = bucket_of(pts[lo].at);
+        size_t mn = lo, mx = lo, hi = lo;
+        for (; hi < pts.size() && bucket_of(pts[hi].at) == b; ++hi) {
+          if (pts[hi].v < pts[mn].v) mn = hi;
+          if (pts[hi].v > pts[mx].v) mx = hi;
+        }
+        drop[pts[mn].at] = drop[pts[mx].at] = 0;
+        lo = hi;
+      }
+    }
+    any = true;
+  }
+  if (any) erase_dropped(all, drop);
+}
+
+// ---- Coalescing of repeated events at flush -------------------------------
+
+inline bool same_payload(const CleanEvent& a, const CleanEvent& b) {
+  if (a.ph != b.ph || a.argc != b.argc || a.sf != b.sf) return false;   // sf: different stacks never merge
+  if (std::strcmp(a.name, b.name) || std::strcmp(a.cat, b.cat) || std::strcmp(a.cname, b.cname)) return false;
+  for (uint8_t i = 0; i < a.argc; ++i) {
+    const Arg& x = a.args[i]; const Arg& y = b.args[i];
+    if (x.kind != y.kind || std::strcmp(x.key, y.key)) return false;
+    if (x.kind == ArgKind::Number && x.num != y.num) return false;
+    if (x.kind == ArgKind::String && std::strcmp(x.str, y.str)) return false;
+  }
+  return true;
+}
+
+// Merge runs of identical complete events / instants on one thread (same name,
+// cat, color, stack frame and args; each no longer than max_us; separated by at most gap_us)
+// into a single slice spanning the run. Slices gain count/total_us/max_us args,
+// instants gain count. Events without room for the extra args are left alone.
+// A B or E ends the thread's run, so merged slices never cross a TRACE_BEGIN/
+// TRACE_END boundary; counters, flows and metadata neither join nor break one.
+inline void coalesce_events(std::vector<CleanEvent>& all, uint64_t gap_us, uint64_t max_us) {
+  if (!gap_us) return;
+  struct Run { size_t head; uint64_t end, total, max; uint32_t count; };
+  std::map<uint32_t, Run> runs;       // open run per tid
+  std::vector<uint8_t> drop(all.size(), 0);
+  bool any = false;
+
+  auto extra_args = [](const CleanEvent& e) { return e.ph == Phase::X ? 3 : 1; };
+  auto finish = [&](Run& r) {
+    if (r.count < 2) return;
+    CleanEvent& h = all[r.head];
+    auto add = [&](const char* k, double v) {
+      Arg& a = h.args[h.argc++];
+      std::snprintf(a.key, sizeof(a.key), "%s", k);
+      a.kind = ArgKind::Number; a.num = v; a.str[0] = 0;
+    };
+    const bool slice = (h.ph == Phase::X);
+    h.ph = Phase::X;
+    h.dur_us = r.end - h.ts_us;
+    add("count", (double)r.count);
+    if (slice) { add("total_us", (double)r.total); add("max_us", (double)r.max); }
+    any = true;
+  };
+
+  for (size_t i = 0; i < all.size(); ++i) {
+    const CleanEvent& e = all[i];
+    if (e.ph == Phase::B || e.ph == Phase::E) {
+      auto it = runs.find(e.tid);
+      if (it != runs.end()) { finish(it->second); runs.erase(it); }
+      continue;
+    }
+    if (e.ph != Phase::X && e.ph != Phase::I) continue;
+    const bool eligible = (e.argc + extra_args(e) <= OTRACE_MAX_ARGS) &&
+                          (e.ph == Phase::I || !max_us || e.dur_us <= max_us);
+    auto it = runs.find(e.tid);
+    if (it != runs.end()) {
+      Run& r = it->second;
+      // 1us of overlap is tolerated: back-to-back scopes can round into each other.
+      if (eligible && e.ts_us + 1 >= r.end && e.ts_us <= r.end + gap_us && same_payload(all[r.head], e)) {
+        drop[i] = 1;
+        r.count++; r.total += e.dur_us; if (e.dur_us > r.max) r.max = e.dur_us;
+        if (e.ts_us + e.dur_us > r.end) r.end = e.ts_us + e.dur_us;
+        continue;
+      }
+      finish(r);
+      runs.erase(it);
+    }
+    if (eligible) runs[e.tid] = Run{ i, e.ts_us + e.dur_us, e.dur_us, e.dur_us, 1 };
+  }
+  for (auto& kv : runs) finish(kv.second);
+  if (any) erase_dropped(all, drop);
+}
+
 // --- rotation/gzip helpers -------------------------------------------------
 
 inline bool ends_with(const char* s, const char* suff) {
@@ -1585,7 +4828,26 @@ inline void write_trace_json_FILE(FILE* f, const std::vector<CleanEvent>& all) {
     write_event_json_common(f, all[i]);
     if (i + 1 != all.size()) std::fputs(",\n", f);
   }
-  std::fputs("\n],\n\"displayTimeUnit\":\"ms\"\n}\n", f);
+  std::fputs("\n],\n", f);
+  {
+    // stackFrames: {"id":{"name":..,"category":..,"parent":id}}, referenced by "sf"
+    Registry& R = reg();
+    std::lock_guard<std::mutex> lk(R.sf_mu);
+    if (!R.stack_frames.empty()) {
+      std::fputs("\"stackFrames\":{\n", f);
+      for (size_t i = 0; i < R.stack_frames.size(); ++i) {
+        const Registry::StackFrame& sf = R.stack_frames[i];
+        std::fprintf(f, "%s\"%zu\":{\"name\":", i ? ",\n" : "", i + 1);
+        json_escape_and_write(f, sf.name.c_str());
+        std::fputs(",\"category\":", f);
+        json_escape_and_write(f, sf.cat.c_str());
+        if (sf.parent) std::fprintf(f, ",\"parent\":%" PRIu32, sf.parent);
+        std::fputc('}', f);
+      }
+      std::fputs("\n},\n", f);
+    }
+  }
+  std::fputs("\"displayTimeUnit\":\"ms\"\n}\n", f);
 }
 
 #if OTRACE_USE_ZLIB || OTRACE_USE_MINIZ
@@ -1748,6 +5010,183 @@ std::remove(tmp_path);
   R.rot_index = (R.rot_index + 1) % (R.max_files ? R.max_files : 1);
 }
 
+#if OTRACE_HEAP
+namespace heap {
+
+// ---- pprof export ----------------------------------------------------------
+// Minimal protobuf writer for perftools.profiles.Profile (profile.proto):
+// varints, length-delimited fields and packed repeated integers only.
+struct PbWriter {
+  std::string buf;
+  void varint(uint64_t v) {
+    while (v >= 0x80) { buf.push_back((char)(v | 0x80)); v >>= 7; }
+    buf.push_back((char)v);
+  }
+  void u64(int field, uint64_t v) { varint((uint64_t)field << 3); varint(v); }
+  void i64(int field, int64_t v)  { u64(field, (uint64_t)v); }
+  void bytes(int field, const std::string& s) {
+    varint(((uint64_t)field << 3) | 2);
+    varint(s.size());
+    buf += s;
+  }
+  template <class T> void packed(int field, const std::vector<T>& vs) {
+    PbWriter inner;
+    for (T v : vs) inner.varint((uint64_t)v);
+    bytes(field, inner.buf);
+  }
+};
+
+// Writes sampled sites as a pprof heap profile with alloc_objects,
+// alloc_space, inuse_objects and inuse_space (estimates scaled by sample
+// weight). A path ending in .gz is gzipped when zlib/miniz is compiled in,
+// otherwise the suffix is dropped and the profile written uncompressed, which
+// pprof reads as well. Returns false if the file could not be written.
+inline bool write_pprof(const char* path) {
+  if (!path || !path[0]) return false;
+  otrace::TracerGuard _tg;
+  async_drain();
+
+  const std::unordered_map<uint64_t, CallsiteStats> callsites = merge_sites();
+  struct InUse { double objects = 0.0, bytes = 0.0; };
+  std::unordered_map<uint64_t, InUse> inuse;
+  state().live.for_each([&](void*, const AllocEntry& e) {
+    if (!e.stack_hash) return;
+    InUse& u = inuse[e.stack_hash];
+    const double w = e.weight > 0.0f ? (double)e.weight : 1.0;
+    u.objects += w;
+    u.bytes += w * (double)e.size;
+  });
+
+  std::vector<std::string> strings{ "" };
+  std::unordered_map<std::string, int64_t> string_ids{ { "", 0 } };
+  auto str = [&](const std::string& s) -> int64_t {
+    auto it = string_ids.find(s);
+    if (it != string_ids.end()) return it->second;
+    strings.push_back(s);
+    return string_ids[s] = (int64_t)strings.size() - 1;
+  };
+
+  // One location per distinct PC; symbolized in a single pass
+  std::vector<void*> pcs;
+  std::unordered_map<void*, uint64_t> loc_ids;
+  for (const auto& kv : callsites)
+    for (int i = 0; i < kv.second.depth; ++i)
+      if (loc_ids.emplace(kv.second.frames[i], pcs.size() + 1).second) pcs.push_back(kv.second.frames[i]);
+  std::vector<FrameSymbol> syms;
+  for (void* pc : pcs) syms.push_back(symbolize(pc));
+
+  PbWriter out;
+  auto value_type = [&](int field, const char* type, const char* unit) {
+    PbWriter vt;
+    vt.i64(1, str(type));
+    vt.i64(2, str(unit));
+    out.bytes(field, vt.buf);
+  };
+  value_type(1, "alloc_objects", "count");
+  value_type(1, "alloc_space",   "bytes");
+  value_type(1, "inuse_objects", "count");
+  value_type(1, "inuse_space",   "bytes");
+
+  for (const auto& kv : callsites) {
+    const CallsiteStats& cs = kv.second;
+    if (cs.depth <= 0) continue;
+    const auto u = inuse.find(kv.first);
+    std::vector<uint64_t> locs;
+    for (int i = 0; i < cs.depth; ++i) locs.push_back(loc_ids[cs.frames[i]]);   // leaf first
+    std::vector<int64_t> vals{
+      (int64_t)std::llround(cs.est_count), (int64_t)std::llround(cs.est_bytes),
+      u == inuse.end() ? 0 : (int64_t)std::llround(u->second.objects),
+      u == inuse.end() ? 0 : (int64_t)std::llround(u->second.bytes) };
+    PbWriter sample;
+    sample.packed(1, locs);
+    sample.packed(2, vals);
+    out.bytes(2, sample.buf);
+  }
+
+  // A single catch-all mapping; functions are already resolved
+  {
+    PbWriter m;
+    m.u64(1, 1);
+    m.u64(3, ~0ull);
+    m.u64(7, 1);   // has_functions
+    out.bytes(3, m.buf);
+  }
+
+  std::map<std::pair<std::string, std::string>, uint64_t> func_ids;   // (name, file)
+  PbWriter funcs;
+  for (size_t i = 0; i < pcs.size(); ++i) {
+    std::string name = syms[i].func;
+    if (name.empty()) {
+      char hex[32];
+      std::snprintf(hex, sizeof(hex), "0x%llx", (unsigned long long)(uintptr_t)pcs[i]);
+      name = hex;
+    }
+    auto f = func_ids.find(std::make_pair(name, syms[i].file));
+    if (f == func_ids.end()) {
+      f = func_ids.emplace(std::make_pair(name, syms[i].file), func_ids.size() + 1).first;
+      PbWriter fn;
+      fn.u64(1, f->second);
+      fn.i64(2, str(name));
+      fn.i64(3, str(name));
+      if (!syms[i].file.empty()) fn.i64(4, str(syms[i].file));
+      funcs.bytes(5, fn.buf);
+    }
+    PbWriter line;
+    line.u64(1, f->second);
+    if (syms[i].line) line.i64(2, (int64_t)syms[i].line);
+    PbWriter loc;
+    loc.u64(1, i + 1);
+    loc.u64(2, 1);
+    loc.u64(3, (uint64_t)(uintptr_t)pcs[i]);
+    loc.bytes(4, line.buf);
+    out.bytes(4, loc.buf);
+  }
+  out.buf += funcs.buf;
+
+  const uint64_t mean = state().sample_bytes.load(std::memory_order_relaxed);
+  const int64_t now_ns = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  const int64_t period_type_str[2] = { str("space"), str("bytes") };
+  const int64_t default_type = str("inuse_space");
+  for (const std::string& s : strings) out.bytes(6, s);
+  out.i64(9, now_ns);
+  {
+    PbWriter vt;
+    vt.i64(1, period_type_str[0]);
+    vt.i64(2, period_type_str[1]);
+    out.bytes(11, vt.buf);
+  }
+  out.i64(12, (int64_t)mean);
+  out.i64(14, default_type);
+
+  // Same .gz handling as the rotated trace writer
+  char final_path[512], tmp_path[512];
+  std::snprintf(final_path, sizeof(final_path), "%s", path);
+  const bool gz = ends_with(final_path, ".gz") && (OTRACE_USE_ZLIB || OTRACE_USE_MINIZ);
+  if (ends_with(final_path, ".gz") && !gz) final_path[std::strlen(final_path) - 3] = '\0';
+  make_tmp_path(tmp_path, sizeof(tmp_path), final_path);
+  otrace::mkpath(final_path);
+  FILE* f = std::fopen(tmp_path, "wb");
+  if (!f) return false;
+  bool ok = std::fwrite(out.buf.data(), 1, out.buf.size(), f) == out.buf.size();
+  if (std::fclose(f) != 0) ok = false;
+  if (ok && gz) {
+#if OTRACE_USE_ZLIB || OTRACE_USE_MINIZ
+    ok = compress_file_to_gzip(tmp_path, final_path, 6);
+#endif
+    std::remove(tmp_path);
+  } else if (ok) {
+    std::remove(final_path);
+    ok = std::rename(tmp_path, final_path) == 0;
+  } else {
+    std::remove(tmp_path);
+  }
+  return ok;
+}
+
+} // namespace heap
+#endif // OTRACE_HEAP
+
 // public API wrapper
 inline void set_output_pattern_api(const char* pattern, uint32_t max_size_mb, uint32_t max_files) {
   set_output_pattern(pattern, max_size_mb, max_files);
@@ -1801,6 +5240,9 @@ inline void flush_file(const char* path) {
 #endif
 
 
+  downsample_counters(all, reg().downsample);
+  coalesce_events(all, reg().coalesce_gap_us, reg().coalesce_max_us);
+
   // If rotation is configured, use it (ignores 'path')
   if (reg().pattern[0]) {
     write_rotated_trace(all);
@@ -1878,7 +5320,8 @@ struct AtEnvInit {
   }
 };
 inline AtEnvInit& envinit() { static AtEnvInit E; return E; }
-struct AtExitHook { AtExitHook(){ (void)envinit(); std::atexit(atexit_flush); } };
+// reg() first, so the registry is destroyed only after the exit flush has run
+struct AtExitHook { AtExitHook(){ (void)reg(); (void)envinit(); std::atexit(atexit_flush); } };
 inline AtExitHook& hook() { static AtExitHook H; return H; }
 
 // --- filter/sampling API (namespace-scope) ---
@@ -1893,57 +5336,337 @@ inline void otrace_set_sampling(double keep) {
   if (keep < 0) keep = 0; if (keep > 1) keep = 1;
   reg().sample_keep = keep;
 }
+inline void otrace_set_stall_threshold_us(uint64_t us) { reg().synth.stall_us = us; }
+inline void otrace_set_counter_downsample(const char* rules) {
+  std::snprintf(reg().downsample, sizeof(reg().downsample), "%s", rules ? rules : "");
+}
+inline void otrace_set_coalesce(uint64_t gap_us, uint64_t max_us) {
+  reg().coalesce_gap_us = gap_us;
+  reg().coalesce_max_us = max_us;
+}
+inline void otrace_set_idle_threads(const char* csv) {
+  std::snprintf(reg().synth.idle_threads, sizeof(reg().synth.idle_threads), "%s", csv ? csv : "");
+}
     
 
 } // namespace otrace
 
 #if OTRACE_HEAP && OTRACE_DEFINE_HEAP_HOOKS
 
-// Global new/delete operators
+#if OTRACE_HEAP_HOOK_MALLOC
+// glibc's real allocator entry points, so the wrappers below can replace the
+// public malloc family by symbol interposition without recursing into it.
+extern "C" {
+void* __libc_malloc(size_t);
+void  __libc_free(void*);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* __libc_memalign(size_t, size_t);
+void* __libc_valloc(size_t);
+void* __libc_pvalloc(size_t);
+}
+#endif
+
+namespace otrace { namespace heap {
+
+// Underlying allocator for the hooks; bypasses the malloc wrappers when present
+inline void* raw_malloc(size_t n) {
+#if OTRACE_HEAP_HOOK_MALLOC
+    return __libc_malloc(n);
+#else
+    return std::malloc(n);
+#endif
+}
+
+// Also frees what the operator new hooks got from raw_malloc; GCC sees that
+// pairing once the hooks inline into user code and warns, correctly but to no
+// purpose, so the check is switched off for this one call.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+inline void raw_free(void* p) {
+#if OTRACE_HEAP_HOOK_MALLOC
+    __libc_free(p);
+#else
+    std::free(p);
+#endif
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+  #pragma GCC diagnostic pop
+#endif
+
+#if OTRACE_HEAP_HOOK_MALLOC
+// realloc keeps the old block's history: its entry leaves the live table
+// before __libc_realloc (so a thread that is handed the old address next
+// cannot have its entry erased by us) and afterwards is either charged as a
+// free or put back unchanged, with its original site, age and size class.
+enum : int { kReallocUntracked = 0, kReallocDetached = 1, kReallocLogged = 2 };
+
+inline int realloc_begin(void* old, AllocEntry& e) {
+    if (!old || otrace::tls_in_tracer) return kReallocUntracked;
+    HeapHookGuard guard;
+    if (!guard.active || !state().enabled.load(std::memory_order_relaxed)) return kReallocUntracked;
+#if OTRACE_HEAP_ASYNC
+    // The table lags the log here, so the free is logged as usual
+    if (async_log(kAsyncFree, old, 0, 0, 0, 0.0)) return kReallocLogged;
+#endif
+    return state().live.erase(old, 0, e) ? kReallocDetached : kReallocUntracked;
+}
+
+// `resized` is true when the old block is gone (moved, resized or freed by size 0)
+inline void realloc_end(void* old, const AllocEntry& e, int held, bool resized) {
+    if (held == kReallocUntracked) return;
+    if (held == kReallocLogged) {
+        // Async mode: the old entry is already queued for removal; re-record the block
+        if (!resized) record_alloc(old, malloc_usable_size(old));
+        return;
+    }
+    HeapHookGuard guard;
+    if (!guard.active) return;
+    if (resized) {
+        state().total_frees.fetch_add(1, std::memory_order_relaxed);
+        release_entry(e, true, 0);
+        return;
+    }
+    bool replaced = false;
+    AllocEntry prev;
+    if (!state().live.insert(old, e, replaced, prev)) release_entry(e, false);
+}
+#endif
+
+inline void* raw_aligned(size_t n, size_t align) {
+#if OTRACE_HEAP_HOOK_MALLOC
+    return __libc_memalign(align, n);
+#elif defined(_WIN32)
+    return _aligned_malloc(n ? n : 1, align);
+#else
+    void* p = nullptr;
+    if (align < sizeof(void*)) align = sizeof(void*);
+    return posix_memalign(&p, align, n ? n : 1) == 0 ? p : nullptr;
+#endif
+}
+
+inline void raw_aligned_free(void* p) {
+#if defined(_WIN32) && !OTRACE_HEAP_HOOK_MALLOC
+    _aligned_free(p);
+#else
+    raw_free(p);
+#endif
+}
+
+// Throwing operator new contract: retry through the new_handler, then throw
+inline bool new_retry() {
+    std::new_handler h = std::get_new_handler();
+    if (h) { h(); return true; }
+#if defined(__cpp_exceptions) || defined(_CPPUNWIND)
+    throw std::bad_alloc();
+#else
+    std::abort();
+#endif
+}
+
+} } // namespace otrace::heap
+
+// Global new/delete operators. Each one calls record_alloc/record_free
+// directly so every captured stack starts with exactly kHookFrames hook frames.
 void* operator new(std::size_t size) {
-    void* ptr = std::malloc(size);
-    if (ptr) otrace::heap::record_alloc(ptr, size);
+    void* ptr;
+    while (!(ptr = otrace::heap::raw_malloc(size ? size : 1))) otrace::heap::new_retry();
+    otrace::heap::record_alloc(ptr, size);
     return ptr;
 }
 
 void operator delete(void* ptr) noexcept {
     otrace::heap::record_free(ptr);
-    std::free(ptr);
+    otrace::heap::raw_free(ptr);
 }
 
 void* operator new[](std::size_t size) {
-    void* ptr = std::malloc(size);
-    if (ptr) otrace::heap::record_alloc(ptr, size);
+    void* ptr;
+    while (!(ptr = otrace::heap::raw_malloc(size ? size : 1))) otrace::heap::new_retry();
+    otrace::heap::record_alloc(ptr, size);
     return ptr;
 }
 
 void operator delete[](void* ptr) noexcept {
     otrace::heap::record_free(ptr);
-    std::free(ptr);
+    otrace::heap::raw_free(ptr);
 }
 
 void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
-    void* ptr = std::malloc(size);
+    void* ptr = otrace::heap::raw_malloc(size ? size : 1);
     if (ptr) otrace::heap::record_alloc(ptr, size);
     return ptr;
 }
 
 void operator delete(void* ptr, const std::nothrow_t&) noexcept {
     otrace::heap::record_free(ptr);
-    std::free(ptr);
+    otrace::heap::raw_free(ptr);
 }
 
 void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
-    void* ptr = std::malloc(size);
+    void* ptr = otrace::heap::raw_malloc(size ? size : 1);
     if (ptr) otrace::heap::record_alloc(ptr, size);
     return ptr;
 }
 
 void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
     otrace::heap::record_free(ptr);
-    std::free(ptr);
+    otrace::heap::raw_free(ptr);
+}
+
+// Sized delete (C++14). The size is known, but the entry still has to leave
+// the live table; frees to empty buckets return before taking any lock.
+void operator delete(void* ptr, std::size_t) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_free(ptr);
+}
+
+#if defined(__cpp_aligned_new)
+// Over-aligned new/delete (C++17)
+void* operator new(std::size_t size, std::align_val_t al) {
+    void* ptr;
+    while (!(ptr = otrace::heap::raw_aligned(size, (size_t)al))) otrace::heap::new_retry();
+    otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void* operator new[](std::size_t size, std::align_val_t al) {
+    void* ptr;
+    while (!(ptr = otrace::heap::raw_aligned(size, (size_t)al))) otrace::heap::new_retry();
+    otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    void* ptr = otrace::heap::raw_aligned(size, (size_t)al);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    void* ptr = otrace::heap::raw_aligned(size, (size_t)al);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_aligned_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_aligned_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_aligned_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_aligned_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_aligned_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    otrace::heap::record_free(ptr);
+    otrace::heap::raw_aligned_free(ptr);
+}
+#endif // __cpp_aligned_new
+
+#if OTRACE_HEAP_HOOK_MALLOC
+// C allocator wrappers (Linux/glibc). Defining these in the executable
+// interposes them for every shared library as well, including allocations
+// libc makes on its own behalf (strdup, fopen, ...).
+extern "C" {
+
+void* malloc(size_t size) {
+    void* ptr = __libc_malloc(size);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void free(void* ptr) {
+    otrace::heap::record_free(ptr);
+    __libc_free(ptr);
 }
 
+void* calloc(size_t n, size_t size) {
+    void* ptr = __libc_calloc(n, size);
+    if (ptr) otrace::heap::record_alloc(ptr, n * size);
+    return ptr;
+}
+
+// Accounted as a free of the old block followed by an allocation of the new
+// one. A failed resize leaves the old block's entry exactly as it was.
+void* realloc(void* old, size_t size) {
+    otrace::heap::AllocEntry e;
+    const int held = otrace::heap::realloc_begin(old, e);
+    void* ptr = __libc_realloc(old, size);
+    otrace::heap::realloc_end(old, e, held, ptr || !size);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void* reallocarray(void* old, size_t n, size_t size) {
+    if (size && n > (size_t)-1 / size) { errno = ENOMEM; return nullptr; }
+    otrace::heap::AllocEntry e;
+    const int held = otrace::heap::realloc_begin(old, e);
+    void* ptr = __libc_realloc(old, n * size);
+    otrace::heap::realloc_end(old, e, held, ptr || !(n && size));
+    if (ptr) otrace::heap::record_alloc(ptr, n * size);
+    return ptr;
+}
+
+int posix_memalign(void** out, size_t align, size_t size) {
+    if (align < sizeof(void*) || (align & (align - 1))) return EINVAL;
+    void* ptr = __libc_memalign(align, size);
+    if (!ptr) return ENOMEM;
+    otrace::heap::record_alloc(ptr, size);
+    *out = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+    void* ptr = __libc_memalign(align, size);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void* memalign(size_t align, size_t size) {
+    void* ptr = __libc_memalign(align, size);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void* valloc(size_t size) {
+    void* ptr = __libc_valloc(size);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+void* pvalloc(size_t size) {
+    void* ptr = __libc_pvalloc(size);
+    if (ptr) otrace::heap::record_alloc(ptr, size);
+    return ptr;
+}
+
+} // extern "C"
+#endif // OTRACE_HEAP_HOOK_MALLOC
+
 #endif // OTRACE_HEAP && OTRACE_DEFINE_HEAP_HOOKS
 
 // ---- Public API macros ----------------------------------------------------
@@ -2000,6 +5723,10 @@ void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
 
 #define OTRACE_ENABLE_SYNTH_TRACKS(on) \
   do{ OTRACE_TOUCH(); ::otrace::reg().synth_enabled.store(!!(on), std::memory_order_release); }while(0)
+#define OTRACE_SET_STALL_THRESHOLD_US(us) \
+  do{ OTRACE_TOUCH(); ::otrace::otrace_set_stall_threshold_us((uint64_t)(us)); }while(0)
+#define OTRACE_SET_IDLE_THREADS(csv) \
+  do{ OTRACE_TOUCH(); ::otrace::otrace_set_idle_threads((csv)); }while(0)
 
 // Frames
 #define OTRACE_MARK_FRAME(idx) \
@@ -2041,15 +5768,63 @@ void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
 #define OTRACE_ENABLE_CATS(csv)      do{ OTRACE_TOUCH(); ::otrace::otrace_enable_cats((csv)); }while(0)
 #define OTRACE_DISABLE_CATS(csv)     do{ OTRACE_TOUCH(); ::otrace::otrace_disable_cats((csv)); }while(0)
 #define OTRACE_SET_SAMPLING(p)       do{ OTRACE_TOUCH(); ::otrace::otrace_set_sampling((p)); }while(0)
+#define OTRACE_SET_COUNTER_DOWNSAMPLE(rules) \
+  do{ OTRACE_TOUCH(); ::otrace::otrace_set_counter_downsample((rules)); }while(0)
+#define OTRACE_SET_COALESCE(gap_us, max_us) \
+  do{ OTRACE_TOUCH(); ::otrace::otrace_set_coalesce((uint64_t)(gap_us), (uint64_t)(max_us)); }while(0)
+
+#if OTRACE_SCOPE_STATS
+#define OTRACE_SCOPE_STATS_SNAPSHOT(vec)  do{ OTRACE_TOUCH(); ::otrace::scope_stats_snapshot((vec)); }while(0)
+#define OTRACE_SCOPE_STATS_DELTA(cursor, vec) do{ OTRACE_TOUCH(); ::otrace::scope_stats_delta((cursor), (vec)); }while(0)
+#define OTRACE_COUNTER_STATS_SNAPSHOT(vec) do{ OTRACE_TOUCH(); ::otrace::counter_stats_snapshot((vec)); }while(0)
+#define OTRACE_METRICS_START(target, interval_ms) \
+  do{ OTRACE_TOUCH(); ::otrace::metrics_start((target), (uint32_t)(interval_ms)); }while(0)
+#define OTRACE_METRICS_STOP()             do{ OTRACE_TOUCH(); ::otrace::metrics_stop(); }while(0)
+#else
+#define OTRACE_SCOPE_STATS_SNAPSHOT(vec)  ((vec).clear())
+#define OTRACE_SCOPE_STATS_DELTA(cursor, vec) ((void)(cursor), (vec).clear())
+#define OTRACE_COUNTER_STATS_SNAPSHOT(vec) ((vec).clear())
+// The exporter publishes the scope tables; without them there is nothing to serve
+#define OTRACE_METRICS_START(target, interval_ms) \
+  do{ static_assert(OTRACE_SCOPE_STATS, "OTRACE_METRICS_START needs -DOTRACE_SCOPE_STATS=1"); }while(0)
+#define OTRACE_METRICS_STOP()             ((void)0)
+#endif
+
+#define OTRACE_MEMORY_SAMPLER_START(interval_ms) \
+  do{ OTRACE_TOUCH(); ::otrace::memory_sampler_start((uint32_t)(interval_ms)); }while(0)
+#define OTRACE_MEMORY_SAMPLER_STOP()      do{ OTRACE_TOUCH(); ::otrace::memory_sampler_stop(); }while(0)
 
 #if OTRACE_HEAP
 #define OTRACE_HEAP_ENABLE(on)        do{ OTRACE_TOUCH(); ::otrace::heap::enable(!!(on)); }while(0)
 #define OTRACE_HEAP_SET_SAMPLING(p)   do{ OTRACE_TOUCH(); ::otrace::heap::set_sampling((p)); }while(0)
+#define OTRACE_HEAP_SET_SAMPLE_BYTES(n) do{ OTRACE_TOUCH(); ::otrace::heap::set_sample_bytes((uint64_t)(n)); }while(0)
 #define OTRACE_HEAP_REPORT()          do{ OTRACE_TOUCH(); ::otrace::heap::generate_report(); }while(0)
+#define OTRACE_HEAP_WRITE_PPROF(path) do{ OTRACE_TOUCH(); (void)::otrace::heap::write_pprof((path)); }while(0)
+#define OTRACE_HEAP_SNAPSHOT(name)    do{ OTRACE_TOUCH(); ::otrace::heap::snapshot((name)); }while(0)
+#define OTRACE_HEAP_DIFF(from, to)    do{ OTRACE_TOUCH(); ::otrace::heap::diff_snapshots((from), (to)); }while(0)
+#define OTRACE_HEAP_SET_AGE_THRESHOLDS(secs, n) do{ OTRACE_TOUCH(); ::otrace::heap::set_age_thresholds((secs), (n)); }while(0)
+#define OTRACE_HEAP_TIMELINE_START(interval_ms, top_k) \
+  do{ OTRACE_TOUCH(); ::otrace::heap::timeline_start((uint32_t)(interval_ms), (uint32_t)(top_k)); }while(0)
+#define OTRACE_HEAP_TIMELINE_STOP()   do{ OTRACE_TOUCH(); ::otrace::heap::timeline_stop(); }while(0)
+#define OTRACE_HEAP_SET_PEAK_MARGIN(f) do{ OTRACE_TOUCH(); ::otrace::heap::set_peak_margin((f)); }while(0)
+#define OTRACE_HEAP_REGISTER(name)    (OTRACE_TOUCH(), ::otrace::heap::register_heap((name)))
+#define OTRACE_HEAP_ALLOC(id, ptr, size) do{ ::otrace::heap::heap_alloc((id), (ptr), (size)); }while(0)
+#define OTRACE_HEAP_FREE(id, ptr)     do{ ::otrace::heap::heap_free((id), (ptr)); }while(0)
 #else
 #define OTRACE_HEAP_ENABLE(on)        ((void)0)
 #define OTRACE_HEAP_SET_SAMPLING(p)   ((void)0)
+#define OTRACE_HEAP_SET_SAMPLE_BYTES(n) ((void)0)
 #define OTRACE_HEAP_REPORT()          ((void)0)
+#define OTRACE_HEAP_WRITE_PPROF(path) ((void)0)
+#define OTRACE_HEAP_SNAPSHOT(name)    ((void)0)
+#define OTRACE_HEAP_DIFF(from, to)    ((void)0)
+#define OTRACE_HEAP_SET_AGE_THRESHOLDS(secs, n) ((void)0)
+#define OTRACE_HEAP_TIMELINE_START(interval_ms, top_k) ((void)0)
+#define OTRACE_HEAP_TIMELINE_STOP()   ((void)0)
+#define OTRACE_HEAP_SET_PEAK_MARGIN(f) ((void)0)
+#define OTRACE_HEAP_REGISTER(name)    (0u)
+#define OTRACE_HEAP_ALLOC(id, ptr, size) ((void)(id))
+#define OTRACE_HEAP_FREE(id, ptr)     ((void)(id))
 #endif
 
 
@@ -2141,6 +5916,17 @@ void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
 #define OTRACE_FLUSH(...)                         ((void)0)
 #define OTRACE_SET_OUTPUT_PATH(...)               ((void)0)
 #define OTRACE_ENABLE_SYNTH_TRACKS(...)         ((void)0)
+#define OTRACE_SET_STALL_THRESHOLD_US(...)        ((void)0)
+#define OTRACE_SET_IDLE_THREADS(...)              ((void)0)
+#define OTRACE_SET_COUNTER_DOWNSAMPLE(...)        ((void)0)
+#define OTRACE_SET_COALESCE(...)                  ((void)0)
+#define OTRACE_SCOPE_STATS_SNAPSHOT(vec)          ((vec).clear())
+#define OTRACE_SCOPE_STATS_DELTA(cursor, vec)     ((void)(cursor), (vec).clear())
+#define OTRACE_COUNTER_STATS_SNAPSHOT(vec)        ((vec).clear())
+#define OTRACE_METRICS_START(...)                 ((void)0)
+#define OTRACE_METRICS_STOP(...)                  ((void)0)
+#define OTRACE_MEMORY_SAMPLER_START(...)          ((void)0)
+#define OTRACE_MEMORY_SAMPLER_STOP(...)           ((void)0)
 
 
 // Keep call-by-name macros so code compiles as no-ops when disabled
@@ -0,0 +1,105 @@
+// Build: c++ -std=c++17 -O2 -shared -fPIC -pthread -ftls-model=initial-exec -I.
+//          tools/otrace_heap_preload.cpp -o libotrace_heap.so   (one command)
+// Use:   LD_PRELOAD=./libotrace_heap.so OTRACE_HEAP_OUT=app_heap.json ./app
+//
+// Heap tracer for unmodified binaries (Linux/glibc). The library interposes
+// malloc/free and the global new/delete family, writes the trace with a heap
+// report at exit, and rewrites it whenever OTRACE_HEAP_SIGNAL is delivered.
+//
+// Environment:
+//   OTRACE_HEAP_OUT=path           Trace file (default otrace_heap.<pid>.json; at most 255 bytes)
+//   OTRACE_HEAP_SAMPLE_BYTES=N     Mean bytes between sampled stacks (default 524288)
+//   OTRACE_HEAP_SAMPLE=p           Per-allocation probability instead (used when SAMPLE_BYTES=0)
+//   OTRACE_HEAP_SIGNAL=N           Signal that dumps a report + trace (default SIGUSR2, 0 = none)
+//   OTRACE_HEAP_TIMELINE_MS=N      Sample heap counter tracks every N ms from a background thread
+//   OTRACE_HEAP_TIMELINE_TOP=K     Site tracks in the timeline (default 8)
+//   OTRACE_MEMORY_MS=N             Sample RSS/page-fault/malloc counters every N ms
+//   OTRACE_DISABLE / OTRACE_ENABLE Recorder switches, as for any otrace build
+#define OTRACE 1
+#define OTRACE_HEAP 1
+#define OTRACE_HEAP_STACKS 1
+#define OTRACE_DEFINE_HEAP_HOOKS 1
+#define OTRACE_HEAP_HOOK_MALLOC 1
+#include "otrace.hpp"
+
+#include <csignal>
+#include <fcntl.h>
+
+namespace {
+
+char g_out[sizeof(otrace::Registry::default_path)];   // what the recorder can hold
+int  g_pipe[2] = { -1, -1 };
+
+void dump() {
+  OTRACE_HEAP_REPORT();
+  OTRACE_FLUSH(g_out);
+}
+
+// Only write(2) here; the dump itself runs on the watcher thread.
+void on_signal(int) {
+  const int saved = errno;
+  char b = 1;
+  if (write(g_pipe[1], &b, 1) < 0) { /* pipe full: a dump is already pending */ }
+  errno = saved;
+}
+
+void watch() {
+  otrace::tls_in_tracer = true;   // nothing this thread does is attributed to the app
+  char b;
+  for (;;) {
+    ssize_t n = read(g_pipe[0], &b, 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    dump();
+  }
+}
+
+// Registered after the recorder's own exit flush, so it runs first and the
+// report lands in the file that flush writes.
+void report_at_exit() { OTRACE_HEAP_REPORT(); }
+
+__attribute__((constructor)) void otrace_heap_preload_init() {
+  OTRACE_TOUCH();
+
+  const char* out = std::getenv("OTRACE_HEAP_OUT");
+  if (out && out[0] && std::strlen(out) < sizeof(g_out)) {
+    std::memcpy(g_out, out, std::strlen(out) + 1);
+  } else {
+    if (out && out[0])
+      std::fprintf(stderr, "otrace: OTRACE_HEAP_OUT is longer than %zu bytes; using the default path\n",
+                   sizeof(g_out) - 1);
+    std::snprintf(g_out, sizeof(g_out), "otrace_heap.%u.json", otrace::pid());
+  }
+  OTRACE_SET_OUTPUT_PATH(g_out);
+
+  const char* bytes = std::getenv("OTRACE_HEAP_SAMPLE_BYTES");
+  const char* prob  = std::getenv("OTRACE_HEAP_SAMPLE");
+  OTRACE_HEAP_SET_SAMPLE_BYTES(bytes ? std::strtoull(bytes, nullptr, 10) : 512u * 1024u);
+  if (prob) OTRACE_HEAP_SET_SAMPLING(std::atof(prob));
+
+  const char* sig = std::getenv("OTRACE_HEAP_SIGNAL");
+  const int signo = sig ? std::atoi(sig) : SIGUSR2;
+  if (signo > 0 && pipe(g_pipe) == 0) {
+    fcntl(g_pipe[1], F_SETFL, O_NONBLOCK);
+    std::thread(watch).detach();
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signo, &sa, nullptr);
+  }
+
+  std::atexit(report_at_exit);
+  OTRACE_HEAP_ENABLE(true);
+
+  const char* tl_ms  = std::getenv("OTRACE_HEAP_TIMELINE_MS");
+  const char* tl_top = std::getenv("OTRACE_HEAP_TIMELINE_TOP");
+  if (tl_ms && std::atoi(tl_ms) > 0)
+    OTRACE_HEAP_TIMELINE_START(std::atoi(tl_ms), tl_top ? std::atoi(tl_top) : 8);
+
+  const char* mem_ms = std::getenv("OTRACE_MEMORY_MS");
+  if (mem_ms && std::atoi(mem_ms) > 0) OTRACE_MEMORY_SAMPLER_START(std::atoi(mem_ms));
+}
+
+} // namespace